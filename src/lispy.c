@@ -1,5 +1,17 @@
+/* For fork, pipes and sysconf, which pmap uses, under -std=c11 */
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "mpc.h"
 
@@ -29,11 +41,14 @@ void add_history(char* unused) {}
 /* Otherwise include the editline headers */
 #else
 #include <editline/readline.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #endif
 
 /* Parser Declariations */
 
 mpc_parser_t* Number;
+mpc_parser_t* Double;
 mpc_parser_t* Symbol;
 mpc_parser_t* String;
 mpc_parser_t* Comment;
@@ -46,22 +61,42 @@ mpc_parser_t* Lispy;
 
 struct lval;
 struct lenv;
+struct lcode;
+struct lmemo;
+struct lvnode;
+struct lstrbuf;
+struct lbig;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lmemo lmemo;
+typedef struct lvnode lvnode;
+typedef struct lstrbuf lstrbuf;
+typedef struct lbig lbig;
+
+/* Evaluate lambda bodies with the bytecode VM, or walk the tree */
+int use_vm = 1;
 
 /* Create Enumeration of Possible lval Types */
 enum {
+  LVAL_ARR,
+  LVAL_CONS,
+  LVAL_DBL,
   LVAL_ERR,
   LVAL_FUN,
   LVAL_NUM,
   LVAL_QEXPR,
   LVAL_SEXPR,
   LVAL_STR,
-  LVAL_SYM
+  LVAL_SYM,
+  LVAL_VEC
 };
 
 char* ltype_name(int t) {
   switch(t) {
+    case LVAL_ARR: return "Array";
+    case LVAL_CONS: return "Cons";
+    case LVAL_DBL: return "Double";
     case LVAL_FUN: return "Function";
     case LVAL_NUM: return "Number";
     case LVAL_ERR: return "Error";
@@ -69,6 +104,7 @@ char* ltype_name(int t) {
     case LVAL_SYM: return "Symbol";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_VEC: return "Vector";
     default: return "Unknown";
   }
 }
@@ -80,64 +116,699 @@ typedef lval*(*lbuiltin)(lenv*, lval*);
 struct lval {
   int type;
 
-  /* Basic*/
-  long num;
-  char* err;
-  char* sym;
-  char* str;
-
-  /* Functions */
-  lbuiltin builtin;
-  lenv* env;
-  lval* formals;
-  lval* body;
+  /* Values are shared, see lval_copy and lval_unshare */
+  int refs;
+
+  /* Collector bookkeeping, and where the lval was allocated */
+  int mark;
+  int gen;
+
+  /* Only the fields for the lval's type are in use */
+  union {
+    /* Basic. Numbers too wide for a long are in 'big', with 'num' set */
+    /* to LONG_MAX or LONG_MIN so tests for zero and sign still work. */
+    struct {
+      long num;
+      lbig* big;
+    };
+    double dbl;
+    char* err;
+    char* sym;
+
+    /* Strings, either owning 'str' or the first 'slen' characters of */
+    /* a buffer shared with other strings, see builtin_join_str */
+    struct {
+      char* str;
+      lstrbuf* buf;
+      size_t slen;
+    };
+
+    /* Functions */
+    struct {
+      lbuiltin builtin;
+      lenv* env;
+      lval* formals;
+      lval* body;
+      lcode* code;
+
+      /* Cached results, for functions wrapped by memo */
+      lmemo* memo;
+    };
+
+    /* Expressions. Slices of another list have a 'base' that owns the */
+    /* cells they point into, see lval_slice. */
+    struct {
+      int count;
+      lval** cell;
+      lval* base;
+    };
+
+    /* Cons cells, linked lists whose tails can be shared */
+    struct {
+      lval* car;
+      lval* cdr;
+    };
+
+    /* Vectors, a trie of 'len' values with the last few kept in 'tail' */
+    struct {
+      int len;
+      int shift;
+      lvnode* root;
+      lvnode* tail;
+    };
+
+    /* Arrays, 'alen' packed longs, or doubles when 'adbl' is set */
+    struct {
+      int alen;
+      int adbl;
+      union {
+        long* ints;
+        double* dbls;
+      };
+    };
+  };
+};
 
-  /* Expressions */
-  int count;
-  lval** cell;
+/* Integers are stored in the lval pointer itself when they fit in all */
+/* but the lowest bit, which is set to tell them apart from real lvals. */
+/* These fixnums are never allocated, freed or shared. */
+#define LVAL_IS_FIXNUM(v) ((uintptr_t)(v) & 1)
+#define LTYPE(v) (LVAL_IS_FIXNUM(v) ? LVAL_NUM : (v)->type)
+#define LNUM(v) (LVAL_IS_FIXNUM(v) ? (long)((intptr_t)(v) >> 1) : (v)->num)
+#define LBIG(v) (LVAL_IS_FIXNUM(v) || (v)->type != LVAL_NUM ? NULL : (v)->big)
+#define LVAL_IS_LONG(v) (LTYPE(v) == LVAL_NUM && !LBIG(v))
+
+/* Integers that don't fit in a long, as a sign and magnitude of 32 bit */
+/* digits, least significant first. Never zero, and results that fit in */
+/* a long are always converted back. */
+struct lbig {
+  int sign;
+  int size;
+  uint32_t d[];
 };
 
 struct lenv {
+  /* Not owned, and only valid while a call is being evaluated */
   lenv* parent;
 
+  /* Collector bookkeeping */
+  int mark;
+
+  /* Bindings in the order they were made */
   int count;
   char** syms;
   lval** vals;
+
+  /* Open addressing table of binding positions plus one, for large */
+  /* environments such as the global one */
+  int* index;
+  int index_size;
+};
+
+/* Bytecode instructions */
+enum {
+  OP_CONST, /* Push a copy of a constant */
+  OP_SYM,   /* Push the value bound to a symbol constant, via a cache */
+  OP_LOCAL, /* Same as OP_SYM, for a formal expected at a frame slot */
+  OP_EVAL,  /* Evaluate the top n values as an S-Expression */
+  OP_TAIL,  /* Same as OP_EVAL, but reusing the frame for lambda calls */
+  OP_FOLD,  /* Push a value computed when compiling, if it is still valid */
+  OP_IF,    /* Branch on the condition if 'if' is still the builtin */
+  OP_IFK,   /* Same as OP_IF, for a condition computed when compiling */
+  OP_JUMP,  /* Continue at another instruction */
+  OP_RET    /* Return the top of the stack */
+};
+
+/* A global value looked up at some instruction, valid while no def has */
+/* happened since */
+typedef struct {
+  long version;
+  lval* val;
+} lcache;
+
+/* The builtins a value computed at compile time relied on. Checked */
+/* again after a def, and against frames binding the same symbols. */
+typedef struct {
+  long version;
+  int count;
+  char** syms;
+  lbuiltin* funs;
+} lfold;
+
+struct lcode {
+  int refs;
+
+  /* Instructions and their operands */
+  int count;
+  int* ops;
+
+  /* Constants referenced by the instructions */
+  int nconsts;
+  lval** consts;
+
+  /* Current and deepest size of the value stack */
+  int depth;
+  int max_depth;
+
+  /* Inline caches of global lookups made by OP_SYM */
+  int ncaches;
+  lcache* caches;
+
+  /* Assumptions made by OP_FOLD and OP_IFK */
+  int nfolds;
+  lfold* folds;
+
+  /* Formals of the lambda, and calls found not to fold so enclosing */
+  /* calls don't try them again, only used while compiling */
+  lval* formals;
+  int nunfolded;
+  lval** unfolded;
+};
+
+/* Results of a function wrapped by memo, keyed by the argument list. */
+/* Entries are grouped in sets of MEMO_WAYS by hash, and a full set */
+/* evicts its least recently used entry. */
+#define MEMO_WAYS 4
+#define MEMO_DEFAULT 4096
+#define MEMO_MAX (1 << 24)
+
+typedef struct {
+  size_t hash;
+  unsigned long used;
+  lval* args;
+  lval* val;
+} lmemo_entry;
+
+struct lmemo {
+  int refs;
+  lval* fun;
+  int nsets;
+  unsigned long clock;
+  lmemo_entry* entries;
+};
+
+/* Characters of strings built by join. Every string using the buffer is */
+/* a prefix of it, so the one as long as the buffer can append in place */
+/* without changing what the others see. */
+#define STR_BUF_MIN 128
+
+struct lstrbuf {
+  int refs;
+  size_t len;
+  size_t cap;
+  char* data;
+};
+
+/* Vectors are tries of VEC_WIDTH way nodes, with values in the leaves. */
+/* Nodes are shared between versions of a vector and copied on write. */
+#define VEC_BITS 5
+#define VEC_WIDTH (1 << VEC_BITS)
+
+struct lvnode {
+  int refs;
+
+  /* Collection it was last traced in */
+  int mark;
+
+  /* Set while it may hold values from the nursery or arena */
+  int young;
+
+  /* Values in leaves, other nodes above them */
+  union {
+    lval* vals[VEC_WIDTH];
+    lvnode* kids[VEC_WIDTH];
+  };
+};
+
+/* Number of live objects, and how many to allow before collecting */
+int gc_live = 0;
+int gc_threshold = 10000;
+
+/* Nesting of lval_eval, collection only happens outside of it */
+int eval_depth = 0;
+
+/* Old lvals, environments and cell arrays come from pools of fixed size */
+/* slots carved out of slabs. Freed slots go on a free list threaded */
+/* through the slot itself, and the collector sweeps by walking slabs. */
+/* Pools are per thread so allocation never needs a lock. */
+#define POOL_SLAB_SIZE (1 << 16)
+
+/* Cell arrays up to this many entries are pooled by power of two */
+#define POOL_CELL_CLASSES 11
+
+#define LTHREAD __thread
+
+typedef struct lslab lslab;
+
+struct lslab {
+  lslab* next;
+  size_t count;
+};
+
+typedef struct {
+  char* name;
+
+  /* Size of a slot, and where a free slot keeps the next free one */
+  size_t size;
+  size_t link;
+
+  void* free;
+  lslab* slabs;
+
+  /* Statistics */
+  long allocs;
+  long frees;
+  long nslabs;
+} lpool;
+
+#define POOL_SLOT(s, p, i) ((void*)((char*)((s) + 1) + (i) * (p)->size))
+
+LTHREAD lpool lval_pool = {
+  "lval", sizeof(lval), offsetof(lval, cell), NULL, NULL, 0, 0, 0 };
+LTHREAD lpool lenv_pool = {
+  "lenv", sizeof(lenv), offsetof(lenv, vals), NULL, NULL, 0, 0, 0 };
+LTHREAD lpool cell_pools[POOL_CELL_CLASSES];
+
+void pool_grow(lpool* p) {
+  size_t n = (POOL_SLAB_SIZE - sizeof(lslab)) / p->size;
+  if (n == 0) { n = 1; }
+
+  lslab* s = malloc(sizeof(lslab) + n * p->size);
+  s->count = n;
+  s->next = p->slabs;
+  p->slabs = s;
+  p->nslabs++;
+
+  /* Fresh slots read as free to the sweep, see lval_new_old and lenv_new */
+  memset(s + 1, 0xFF, n * p->size);
+
+  for (size_t i = n; i-- > 0;) {
+    char* x = POOL_SLOT(s, p, i);
+    *(void**)(x + p->link) = p->free;
+    p->free = x;
+  }
+}
+
+void* pool_alloc(lpool* p) {
+  if (!p->free) { pool_grow(p); }
+  char* x = p->free;
+  p->free = *(void**)(x + p->link);
+  p->allocs++;
+  return x;
+}
+
+void pool_free(lpool* p, void* x) {
+  *(void**)((char*)x + p->link) = p->free;
+  p->free = x;
+  p->frees++;
+}
+
+/* Pool for cell arrays with room for 'cap' entries, a power of two */
+lpool* cell_pool(int cap) {
+  int k = 0;
+  while ((1 << k) < cap) { k++; }
+  if (k >= POOL_CELL_CLASSES) { return NULL; }
+
+  lpool* p = &cell_pools[k];
+  if (!p->size) {
+    p->name = "cells";
+    p->size = sizeof(lval*) << k;
+  }
+  return p;
+}
+
+lval** cells_alloc(int cap) {
+  lpool* p = cell_pool(cap);
+  return p ? pool_alloc(p) : malloc(sizeof(lval*) * cap);
+}
+
+void cells_free(lval** cell, int cap) {
+  if (!cap) { return; }
+  lpool* p = cell_pool(cap);
+  if (p) { pool_free(p, cell); } else { free(cell); }
+}
+
+/* Generations an lval can be allocated in */
+enum { LGEN_OLD, LGEN_YOUNG, LGEN_ARENA };
+
+/* Young lvals are bump allocated from fixed size blocks. Blocks are */
+/* aligned to their size so an lval can find its block. Freed slots go */
+/* on a free list in their block so a block that is partly live can be */
+/* refilled, and a block is reset as soon as every lval in it has died. */
+#define NURSERY_BLOCK_SIZE (1 << 16)
+#define NURSERY_CHUNK_BLOCKS 16
+
+typedef struct lblock lblock;
+
+struct lblock {
+  lblock* next;      /* Every block */
+  lblock* next_free; /* Blocks with room for more lvals */
+
+  /* Slots handed out and slots still in use */
+  int used;
+  int live;
+
+  /* Set while on the list of blocks with room */
+  int listed;
+
+  /* Freed slots below 'used', linked like pool slots */
+  lval* free;
+
+  lval slots[];
 };
 
+#define NURSERY_SLOTS \
+  ((int)((NURSERY_BLOCK_SIZE - sizeof(lblock)) / sizeof(lval)))
+
+#define NURSERY_LINK(v) (*(lval**)((char*)(v) + offsetof(lval, cell)))
+
+lblock* nursery_blocks = NULL;
+lblock* nursery_free = NULL;
+lblock* nursery_current = NULL;
+
+lblock* nursery_block_of(lval* v) {
+  return (lblock*)((uintptr_t)v & ~(uintptr_t)(NURSERY_BLOCK_SIZE - 1));
+}
+
+void nursery_grow(void) {
+  /* Allocate a chunk of blocks with room to align them by hand */
+  char* raw = malloc(NURSERY_BLOCK_SIZE * (NURSERY_CHUNK_BLOCKS + 1));
+  uintptr_t start = ((uintptr_t)raw + NURSERY_BLOCK_SIZE - 1)
+    & ~(uintptr_t)(NURSERY_BLOCK_SIZE - 1);
+
+  for (int i = 0; i < NURSERY_CHUNK_BLOCKS; i++) {
+    lblock* b = (lblock*)(start + (uintptr_t)i * NURSERY_BLOCK_SIZE);
+    b->used = 0;
+    b->live = 0;
+    b->listed = 1;
+    b->free = NULL;
+    b->next = nursery_blocks;
+    nursery_blocks = b;
+    b->next_free = nursery_free;
+    nursery_free = b;
+  }
+}
+
+lval* nursery_alloc(void) {
+  lblock* b = nursery_current;
+
+  /* Once the current block is full move on to the next one with room */
+  if (!b || (!b->free && b->used == NURSERY_SLOTS)) {
+    if (!nursery_free) { nursery_grow(); }
+    b = nursery_free;
+    nursery_free = b->next_free;
+    b->listed = 0;
+    nursery_current = b;
+  }
+
+  b->live++;
+  gc_live++;
+
+  /* Reuse freed slots before bumping */
+  lval* v = b->free;
+  if (v) {
+    b->free = NURSERY_LINK(v);
+    return v;
+  }
+  return &b->slots[b->used++];
+}
+
+void nursery_release(lval* v) {
+  lblock* b = nursery_block_of(v);
+  v->refs = 0;
+  gc_live--;
+
+  /* Once nothing in the block is live it can be bumped through again */
+  if (--b->live == 0) {
+    b->used = 0;
+    b->free = NULL;
+  } else {
+    NURSERY_LINK(v) = b->free;
+    b->free = v;
+  }
+
+  if (b != nursery_current && !b->listed) {
+    b->listed = 1;
+    b->next_free = nursery_free;
+    nursery_free = b;
+  }
+}
+
+/* With --arena, lvals and their cell arrays are bump allocated from a */
+/* region opened for each top level expression. Nothing in a region is */
+/* freed on its own, the whole region is reset once the expression is */
+/* done. Values that outlive it are promoted by def like young ones. */
+#define ARENA_CHUNK_LVALS 4096
+#define ARENA_CHUNK_BYTES (1 << 20)
+
+int use_arena = 0;
+
+/* Number of regions currently open */
+int arena_depth = 0;
+
+/* Chunks of lval slots, and the index of the next free slot */
+lval** arena_lvals = NULL;
+int arena_nlvals = 0;
+int arena_top = 0;
+
+/* Chunks of memory for cell arrays, and the position in them */
+char** arena_bytes = NULL;
+size_t* arena_sizes = NULL;
+int arena_nbytes = 0;
+int arena_chunk = 0;
+size_t arena_offset = 0;
+
+/* Position to reset the arena to when a region is closed */
+typedef struct {
+  int top;
+  int chunk;
+  size_t offset;
+} larena;
+
+lval* arena_alloc(void) {
+  int c = arena_top / ARENA_CHUNK_LVALS;
+  if (c == arena_nlvals) {
+    arena_nlvals++;
+    arena_lvals = realloc(arena_lvals, sizeof(lval*) * arena_nlvals);
+    arena_lvals[c] = malloc(sizeof(lval) * ARENA_CHUNK_LVALS);
+  }
+  return &arena_lvals[c][arena_top++ % ARENA_CHUNK_LVALS];
+}
+
+void* arena_alloc_bytes(size_t n) {
+  n = (n + 7) & ~(size_t)7;
+
+  while (1) {
+    /* Add a chunk, large enough for oversized arrays */
+    if (arena_chunk == arena_nbytes) {
+      arena_nbytes++;
+      arena_bytes = realloc(arena_bytes, sizeof(char*) * arena_nbytes);
+      arena_sizes = realloc(arena_sizes, sizeof(size_t) * arena_nbytes);
+      arena_sizes[arena_chunk] = n > ARENA_CHUNK_BYTES ? n : ARENA_CHUNK_BYTES;
+      arena_bytes[arena_chunk] = malloc(arena_sizes[arena_chunk]);
+    }
+
+    if (arena_offset + n <= arena_sizes[arena_chunk]) {
+      void* p = arena_bytes[arena_chunk] + arena_offset;
+      arena_offset += n;
+      return p;
+    }
+
+    /* Move on to the next chunk, replacing it if it is too small */
+    arena_chunk++;
+    arena_offset = 0;
+    if (arena_chunk < arena_nbytes && arena_sizes[arena_chunk] < n) {
+      free(arena_bytes[arena_chunk]);
+      arena_sizes[arena_chunk] = n;
+      arena_bytes[arena_chunk] = malloc(n);
+    }
+  }
+}
+
+larena arena_open(void) {
+  larena m = { arena_top, arena_chunk, arena_offset };
+  if (use_arena) { arena_depth++; }
+  return m;
+}
+
+void arena_close(larena m);
+
+/* Symbol names are interned, so there is only ever one copy of each */
+/* name and two symbols are the same exactly when their names are the */
+/* same pointer. Interned names live for the rest of the program. */
+typedef struct {
+  /* Bindings in environments other than the global one */
+  int frames;
+
+  /* Position of the global binding, or -1 */
+  int global;
+
+  char name[];
+} lsym;
+
+#define SYM_INFO(s) ((lsym*)((s) - offsetof(lsym, name)))
+
+char** sym_table = NULL;
+size_t sym_size = 0;
+size_t sym_count = 0;
+
+/* Interned names the evaluator compares against */
+char* sym_amp;
+char* sym_if;
+
+size_t sym_hash(char* s) {
+  /* FNV-1a */
+  size_t h = 2166136261u;
+  while (*s) { h = (h ^ (unsigned char)*s++) * 16777619u; }
+  return h;
+}
+
+char* sym_intern(char* s) {
+  /* Keep the table at most half full */
+  if (sym_count * 2 >= sym_size) {
+    char** old = sym_table;
+    size_t old_size = sym_size;
+    sym_size = sym_size ? sym_size * 2 : 256;
+    sym_table = calloc(sym_size, sizeof(char*));
+    for (size_t i = 0; i < old_size; i++) {
+      if (!old[i]) { continue; }
+      size_t j = sym_hash(old[i]) & (sym_size - 1);
+      while (sym_table[j]) { j = (j + 1) & (sym_size - 1); }
+      sym_table[j] = old[i];
+    }
+    free(old);
+  }
+
+  size_t i = sym_hash(s) & (sym_size - 1);
+  while (sym_table[i]) {
+    if (strcmp(sym_table[i], s) == 0) { return sym_table[i]; }
+    i = (i + 1) & (sym_size - 1);
+  }
+
+  lsym* info = malloc(sizeof(lsym) + strlen(s) + 1);
+  info->frames = 0;
+  info->global = -1;
+  strcpy(info->name, s);
+  sym_table[i] = info->name;
+  sym_count++;
+  return sym_table[i];
+}
+
+/* The environment that def binds into */
+lenv* lenv_global = NULL;
+
+/* Bumped by every def so cached global lookups can tell they are stale */
+long lenv_version = 0;
+
+/* A negative count marks a free lenv slot */
 lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
+  lenv* e = pool_alloc(&lenv_pool);
   e->parent = NULL;
+  e->mark = 0;
   e->count = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->index = NULL;
+  e->index_size = 0;
+  gc_live++;
 
   return e;
 }
 
+void lenv_free(lenv* e) {
+  if (e != lenv_global) {
+    for (int i = 0; i < e->count; i++) { SYM_INFO(e->syms[i])->frames--; }
+  }
+  free(e->syms);
+  free(e->vals);
+  free(e->index);
+  e->count = -1;
+  pool_free(&lenv_pool, e);
+  gc_live--;
+}
+
+/* Cell arrays have room for the next power of two of their count, so */
+/* appending is cheap and the array's size class follows from its count */
+int lval_capacity(int n) {
+  int c = 1;
+  while (c < n) { c <<= 1; }
+  return n ? c : 0;
+}
+
 void lval_del(lval* e);
 lval* lval_err(char* fmt, ...);
 lval* lval_copy(lval* e);
+lval* lval_unshare(lval* v);
+void lval_vec_share(lval* x, lval* v);
+lcode* lcode_compile(lval* formals, lval* body);
+void lcode_del(lcode* c);
+void lcode_free(lcode* c);
+void gc_push_root(lval* v);
+void gc_pop_root(void);
+void gc_safepoint(lenv* e);
 
 void lenv_del(lenv* e) {
   for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
     lval_del(e->vals[i]);
   }
-  free(e->syms);
-  free(e->vals);
-  free(e);
+  lenv_free(e);
 }
 
-lval* lenv_get(lenv* e, lval* k) {
+/* Environments with this many bindings get a hash index */
+#define LENV_INDEX_MIN 16
 
-  /* Iterate over all the items in environment */
-  for (int i = 0; i < e->count; i++) {
-    /* Check if the stored string matches the symbol string */
-    /* If it does, return a copy of the value */
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
+size_t lenv_hash(char* sym) {
+  /* Symbols are interned so their address identifies them */
+  uint64_t h = ((uintptr_t)sym >> 4) * 0x9E3779B97F4A7C15ull;
+  return (size_t)(h ^ (h >> 32));
+}
+
+void lenv_index_add(lenv* e, int i) {
+  size_t m = e->index_size - 1;
+  size_t j = lenv_hash(e->syms[i]) & m;
+  while (e->index[j]) { j = (j + 1) & m; }
+  e->index[j] = i + 1;
+}
+
+/* Rebuilds the index with room for the current bindings */
+void lenv_reindex(lenv* e) {
+  free(e->index);
+  e->index_size = 2 * LENV_INDEX_MIN;
+  while (e->index_size < 2 * e->count) { e->index_size *= 2; }
+  e->index = calloc(e->index_size, sizeof(int));
+  for (int i = 0; i < e->count; i++) { lenv_index_add(e, i); }
+}
+
+/* Returns the position of the binding of 'sym' in 'e', or -1 */
+int lenv_find(lenv* e, char* sym) {
+  if (e->index) {
+    size_t m = e->index_size - 1;
+    for (size_t j = lenv_hash(sym) & m; e->index[j]; j = (j + 1) & m) {
+      if (e->syms[e->index[j] - 1] == sym) { return e->index[j] - 1; }
     }
+    return -1;
+  }
+
+  for (int i = 0; i < e->count; i++) {
+    if (e->syms[i] == sym) { return i; }
+  }
+  return -1;
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+
+  /* Scope is dynamic, so any frame could bind the symbol. When none do */
+  /* it can go straight to its global binding. */
+  lsym* s = SYM_INFO(k->sym);
+  if (s->frames == 0 && s->global >= 0) {
+    return lval_copy(lenv_global->vals[s->global]);
+  }
+
+  /* Check if the symbol is bound here */
+  /* If it is, return a copy of the value */
+  int i = lenv_find(e, k->sym);
+  if (i >= 0) {
+    return lval_copy(e->vals[i]);
   }
 
   /* If no symbol found first check in parent */
@@ -150,17 +821,18 @@ lval* lenv_get(lenv* e, lval* k) {
 }
 
 lenv* lenv_copy(lenv* e) {
-  lenv* n = malloc(sizeof(lenv));
+  lenv* n = lenv_new();
   n->parent = e->parent;
   n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(lval*) * n->count);
+  n->syms = malloc(sizeof(char*) * lval_capacity(n->count));
+  n->vals = malloc(sizeof(lval*) * lval_capacity(n->count));
 
   for (int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
+    n->syms[i] = e->syms[i];
     n->vals[i] = lval_copy(e->vals[i]);
+    SYM_INFO(n->syms[i])->frames++;
   }
+  if (e->index) { lenv_reindex(n); }
 
   return n;
 }
@@ -170,7 +842,7 @@ char* lenv_get_fname_from_builtin(lenv* e, lval *v) {
   for (int i = 0; i < e->count; i++) {
     /* Check if the function matches the lval's function */
     /* If it does, return a copy of the value */
-    if (e->vals[i]->builtin == v->builtin) {
+    if (LTYPE(e->vals[i]) == LVAL_FUN && e->vals[i]->builtin == v->builtin) {
       return e->syms[i];
     }
   }
@@ -180,183 +852,795 @@ char* lenv_get_fname_from_builtin(lenv* e, lval *v) {
 }
 
 void lenv_put(lenv* e, lval* k, lval* v) {
-  /* Iterate over all the items in environment */
-  /* This is to see if variable already exists */
-  for (int i = 0; i < e->count; i++) {
-    /* If the variable is found delete item at that position */
-    /* And replace with variable supplied by user */
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
+  /* See if variable already exists */
+  /* If it does delete the item at that position */
+  /* And replace with variable supplied by user */
+  int i = lenv_find(e, k->sym);
+  if (i >= 0) {
+    lval_del(e->vals[i]);
+    e->vals[i] = lval_copy(v);
+    return;
   }
 
-  /* If no existing entry found allocate space for new entry */
+  /* If no existing entry found make space for a new entry, doubling */
+  /* the arrays when they are full */
+  int cap = lval_capacity(e->count + 1);
+  if (cap != lval_capacity(e->count)) {
+    e->vals = realloc(e->vals, sizeof(lval*) * cap);
+    e->syms = realloc(e->syms, sizeof(char*) * cap);
+  }
   e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
 
-  /* Copy contents of lval and symbol string into new location */
+  /* Copy contents of lval and symbol into new location */
   e->vals[e->count - 1] = lval_copy(v);
-  e->syms[e->count - 1] = malloc(strlen(k->sym)+1);
-  strcpy(e->syms[e->count - 1], k->sym);
+  e->syms[e->count - 1] = k->sym;
+
+  if (e == lenv_global) {
+    SYM_INFO(k->sym)->global = e->count - 1;
+  } else {
+    SYM_INFO(k->sym)->frames++;
+  }
+
+  /* Keep the index at most half full */
+  if (e->index && 2 * e->count <= e->index_size) {
+    lenv_index_add(e, e->count - 1);
+  } else if (e->count >= LENV_INDEX_MIN) {
+    lenv_reindex(e);
+  }
 }
 
+lval* lval_promote(lval* v);
+
 void lenv_def(lenv* e, lval* k, lval* v) {
   /* Iterate until e has no parent */
   while (e->parent) {
     e = e->parent;
   }
 
+  /* Globals outlive the expression so move them out of the nursery */
+  v = lval_promote(lval_copy(v));
+
   /* Put value in e */
   lenv_put(e, k ,v);
+  lval_del(v);
+  lenv_version++;
 }
 
-/* Construct a pointer to a new Number type lval */
-lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
-  v->num = x;
-
+/* Allocate a young lval of the given type with a single reference */
+lval* lval_new(int type) {
+  lval* v;
+  if (arena_depth) {
+    v = arena_alloc();
+    v->gen = LGEN_ARENA;
+  } else {
+    v = nursery_alloc();
+    v->gen = LGEN_YOUNG;
+  }
+  v->type = type;
+  v->refs = 1;
+  v->mark = 0;
   return v;
 }
 
-/* Construct a pointer to a new Error type lval */
-lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
-
-  /* Create a va list and initialize it */
-  va_list va;
-  va_start(va, fmt);
+/* Allocate an lval outside of the nursery, for values that will outlive */
+/* the current expression. Pool slots with no references are free. */
+lval* lval_new_old(int type) {
+  lval* v = pool_alloc(&lval_pool);
+  v->type = type;
+  v->refs = 1;
+  v->mark = 0;
+  v->gen = LGEN_OLD;
+  gc_live++;
+  return v;
+}
 
-  /* Allocate 512 bytes of space */
-  v->err = malloc(512);
+void lval_free(lval* v) {
+  if (v->gen == LGEN_YOUNG) {
+    nursery_release(v);
+  } else {
+    v->refs = 0;
+    pool_free(&lval_pool, v);
+    gc_live--;
+  }
+}
 
-  /* printf the error string with a maximum of 511 characters */
-  vsnprintf(v->err, 511, fmt, va);
+/* Construct a pointer to a new Number type lval */
+/* Whether shifting 'x' into a fixnum keeps its top bit */
+int lval_fixnum_fits(long x) {
+  return ((intptr_t)((uintptr_t)x << 1) >> 1) == x;
+}
 
-  /* Reallocate to number of bytes actually used */
-  v->err = realloc(v->err, strlen(v->err)+1);
+lval* lval_num(long x) {
+  if (lval_fixnum_fits(x)) { return (lval*)(((uintptr_t)x << 1) | 1); }
 
-  /* Cleanup our va list */
-  va_end(va);
+  lval* v = lval_new(LVAL_NUM);
+  v->num = x;
+  v->big = NULL;
 
   return v;
 }
 
-/* Construct a pointer to a new Symbol type lval */
-lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
-
+/* Construct a pointer to a new Double type lval */
+lval* lval_dbl(double x) {
+  lval* v = lval_new(LVAL_DBL);
+  v->dbl = x;
   return v;
 }
 
-/* Construct a pointer to a new String type lval */
-lval* lval_str(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
-  v->str = malloc(strlen(s) + 1);
-  strcpy(v->str, s);
+/* Magnitudes are arrays of 32 bit digits, least significant first, and */
+/* may have leading zeros */
+int big_trim(uint32_t* d, int n) {
+  while (n && !d[n-1]) { n--; }
+  return n;
+}
 
-  return v;
+int big_cmp(uint32_t* a, int an, uint32_t* b, int bn) {
+  an = big_trim(a, an);
+  bn = big_trim(b, bn);
+  if (an != bn) { return an < bn ? -1 : 1; }
+  for (int i = an - 1; i >= 0; i--) {
+    if (a[i] != b[i]) { return a[i] < b[i] ? -1 : 1; }
+  }
+  return 0;
 }
 
-/* Construct a pointer to a new empty Sexpr type lval */
-lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
-  v->count = 0;
-  v->cell = NULL;
+/* r += a, where r has at least as many digits as a. Returns the carry. */
+uint32_t big_add_into(uint32_t* r, int rn, uint32_t* a, int an) {
+  uint64_t c = 0;
+  int i = 0;
+  for (; i < an; i++) {
+    c += (uint64_t)r[i] + a[i];
+    r[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  for (; c && i < rn; i++) {
+    c += r[i];
+    r[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  return (uint32_t)c;
+}
 
-  return v;
+/* r -= a, where r is at least a */
+void big_sub_into(uint32_t* r, int rn, uint32_t* a, int an) {
+  int64_t b = 0;
+  int i = 0;
+  for (; i < an; i++) {
+    int64_t t = (int64_t)r[i] - a[i] - b;
+    r[i] = (uint32_t)t;
+    b = t < 0;
+  }
+  for (; b && i < rn; i++) {
+    int64_t t = (int64_t)r[i] - b;
+    r[i] = (uint32_t)t;
+    b = t < 0;
+  }
 }
 
-/* Construct a pointer to a new empty Qexpr lval */
-lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
-  v->count = 0;
-  v->cell = NULL;
-  return v;
+/* r = a * b, with an + bn digits in r */
+void big_mul_basic(uint32_t* r, uint32_t* a, int an, uint32_t* b, int bn) {
+  memset(r, 0, sizeof(uint32_t) * (an + bn));
+  for (int i = 0; i < an; i++) {
+    uint64_t c = 0;
+    for (int j = 0; j < bn; j++) {
+      c += (uint64_t)a[i] * b[j] + r[i+j];
+      r[i+j] = (uint32_t)c;
+      c >>= 32;
+    }
+    r[i+bn] = (uint32_t)c;
+  }
 }
 
-/* Construct a pointer to a new function type lval */
-lval* lval_fun(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
-  v->builtin = func;
+/* Operands shorter than this are multiplied digit by digit */
+#define KARATSUBA_MIN 32
 
-  return v;
-}
+/* r = a * b, with an + bn digits in r, using Karatsuba's method for */
+/* large operands */
+void big_mul(uint32_t* r, uint32_t* a, int an, uint32_t* b, int bn) {
+  if (an < bn) {
+    uint32_t* t = a; a = b; b = t;
+    int tn = an; an = bn; bn = tn;
+  }
 
-/* Construct a pointer to a new lambda type lval */
-lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  if (bn < KARATSUBA_MIN) {
+    big_mul_basic(r, a, an, b, bn);
+    return;
+  }
 
-  /* Set builtin to Null */
-  v->builtin = NULL;
+  /* A much longer 'a' is multiplied by 'b' a piece at a time */
+  if (an >= 2 * bn) {
+    uint32_t* t = malloc(sizeof(uint32_t) * 2 * bn);
+    memset(r, 0, sizeof(uint32_t) * (an + bn));
+    for (int i = 0; i < an; i += bn) {
+      int k = an - i < bn ? an - i : bn;
+      big_mul(t, a + i, k, b, bn);
+      big_add_into(r + i, an + bn - i, t, k + bn);
+    }
+    free(t);
+    return;
+  }
 
-  /* Build new environment */
-  v->env = lenv_new();
+  /* Split a = a1 B^h + a0 and b = b1 B^h + b0. Then a0 b0 and a1 b1 */
+  /* fill the low and high parts of the result. */
+  int h = an / 2;
+  int a1n = an - h;
+  int b1n = bn - h;
+  big_mul(r, a, h, b, h);
+  big_mul(r + 2*h, a + h, a1n, b + h, b1n);
+
+  /* The middle part is (a0 + a1)(b0 + b1) - a0 b0 - a1 b1 */
+  int sn = a1n + 1;
+  int tn = (b1n > h ? b1n : h) + 1;
+  uint32_t* sa = calloc(sn + tn, sizeof(uint32_t));
+  uint32_t* sb = sa + sn;
+  memcpy(sa, a + h, sizeof(uint32_t) * a1n);
+  big_add_into(sa, sn, a, h);
+  if (b1n > h) {
+    memcpy(sb, b + h, sizeof(uint32_t) * b1n);
+    big_add_into(sb, tn, b, h);
+  } else {
+    memcpy(sb, b, sizeof(uint32_t) * h);
+    big_add_into(sb, tn, b + h, b1n);
+  }
 
-  /* Set formals and body */
-  v->formals = formals;
-  v->body = body;
+  uint32_t* z = malloc(sizeof(uint32_t) * (sn + tn));
+  big_mul(z, sa, sn, sb, tn);
+  big_sub_into(z, sn + tn, r, 2*h);
+  big_sub_into(z, sn + tn, r + 2*h, a1n + b1n);
+  big_add_into(r + h, an + bn - h, z, big_trim(z, sn + tn));
 
-  return v;
+  free(z);
+  free(sa);
 }
 
-void lval_del(lval* v) {
-  switch (v->type) {
-    /* Do nothing specifal for number type */
-    case LVAL_NUM: break;
+/* q = a / d for a single digit d, returning the remainder. 'q' may be 'a'. */
+uint32_t big_div_small(uint32_t* q, uint32_t* a, int an, uint32_t d) {
+  uint64_t r = 0;
+  for (int i = an - 1; i >= 0; i--) {
+    r = (r << 32) | a[i];
+    q[i] = (uint32_t)(r / d);
+    r %= d;
+  }
+  return (uint32_t)r;
+}
 
-    case LVAL_FUN:;
+/* q = a / b, with an - bn + 1 digits in q, for b of at least two digits */
+/* with no leading zeros. This is Knuth's algorithm D. */
+void big_div(uint32_t* q, uint32_t* a, int an, uint32_t* b, int bn) {
+  /* Normalize so the divisor's top digit has its top bit set */
+  int s = __builtin_clz(b[bn-1]);
+  uint32_t* vn = malloc(sizeof(uint32_t) * bn);
+  uint32_t* un = malloc(sizeof(uint32_t) * (an + 1));
+  for (int i = bn - 1; i > 0; i--) {
+    vn[i] = (b[i] << s) | (uint32_t)((uint64_t)b[i-1] >> (32 - s));
+  }
+  vn[0] = b[0] << s;
+  un[an] = (uint32_t)((uint64_t)a[an-1] >> (32 - s));
+  for (int i = an - 1; i > 0; i--) {
+    un[i] = (a[i] << s) | (uint32_t)((uint64_t)a[i-1] >> (32 - s));
+  }
+  un[0] = a[0] << s;
+
+  for (int j = an - bn; j >= 0; j--) {
+    /* Estimate the quotient digit from the top two digits */
+    uint64_t num = ((uint64_t)un[j+bn] << 32) | un[j+bn-1];
+    uint64_t qhat = num / vn[bn-1];
+    uint64_t rhat = num % vn[bn-1];
+    while (qhat >> 32 || qhat * vn[bn-2] > ((rhat << 32) | un[j+bn-2])) {
+      qhat--;
+      rhat += vn[bn-1];
+      if (rhat >> 32) { break; }
+    }
+
+    /* Multiply and subtract */
+    int64_t k = 0;
+    int64_t t;
+    for (int i = 0; i < bn; i++) {
+      uint64_t p = qhat * vn[i];
+      t = (int64_t)un[i+j] - k - (int64_t)(p & 0xFFFFFFFF);
+      un[i+j] = (uint32_t)t;
+      k = (int64_t)(p >> 32) - (t >> 32);
+    }
+    t = (int64_t)un[j+bn] - k;
+    un[j+bn] = (uint32_t)t;
+
+    /* The estimate was one too big, add back */
+    q[j] = (uint32_t)qhat;
+    if (t < 0) {
+      q[j]--;
+      uint64_t c = 0;
+      for (int i = 0; i < bn; i++) {
+        c += (uint64_t)un[i+j] + vn[i];
+        un[i+j] = (uint32_t)c;
+        c >>= 32;
+      }
+      un[j+bn] += (uint32_t)c;
+    }
+  }
+
+  free(vn);
+  free(un);
+}
+
+/* The number with the given sign and magnitude, as a long if it fits */
+lval* lval_big(int sign, uint32_t* d, int n) {
+  n = big_trim(d, n);
+  if (n == 0) { return lval_num(0); }
+
+  if (n <= 2) {
+    uint64_t m = d[0] | (n == 2 ? (uint64_t)d[1] << 32 : 0);
+    if (sign > 0 && m <= LONG_MAX) { return lval_num((long)m); }
+    if (sign < 0 && m <= (uint64_t)LONG_MAX) { return lval_num(-(long)m); }
+    if (sign < 0 && m == (uint64_t)LONG_MAX + 1) { return lval_num(LONG_MIN); }
+  }
+
+  lval* v = lval_new(LVAL_NUM);
+  v->num = sign > 0 ? LONG_MAX : LONG_MIN;
+  v->big = malloc(sizeof(lbig) + sizeof(uint32_t) * n);
+  v->big->sign = sign;
+  v->big->size = n;
+  memcpy(v->big->d, d, sizeof(uint32_t) * n);
+  return v;
+}
+
+lbig* lbig_copy(lbig* b) {
+  if (!b) { return NULL; }
+  size_t size = sizeof(lbig) + sizeof(uint32_t) * b->size;
+  lbig* x = malloc(size);
+  memcpy(x, b, size);
+  return x;
+}
+
+/* Any number as a sign and magnitude, for the bignum routines. Small */
+/* numbers are stored in 'buf'. */
+typedef struct {
+  int sign;
+  int size;
+  uint32_t* d;
+  uint32_t buf[2];
+} lbigview;
+
+void lval_big_view(lval* v, lbigview* x) {
+  if (LBIG(v)) {
+    x->sign = v->big->sign;
+    x->size = v->big->size;
+    x->d = v->big->d;
+    return;
+  }
+
+  long n = LNUM(v);
+  uint64_t m = n < 0 ? 0 - (uint64_t)n : (uint64_t)n;
+  x->sign = (n > 0) - (n < 0);
+  x->buf[0] = (uint32_t)m;
+  x->buf[1] = (uint32_t)(m >> 32);
+  x->d = x->buf;
+  x->size = big_trim(x->buf, 2);
+}
+
+/* x + y, or x - y when 'ysign' is -1 */
+lval* lval_big_add(lval* x, lval* y, int ysign) {
+  lbigview a, b;
+  lval_big_view(x, &a);
+  lval_big_view(y, &b);
+  b.sign *= ysign;
+
+  int n = (a.size > b.size ? a.size : b.size) + 1;
+  uint32_t* r = calloc(n, sizeof(uint32_t));
+  int sign;
+  if (a.sign == b.sign || b.sign == 0) {
+    memcpy(r, a.d, sizeof(uint32_t) * a.size);
+    big_add_into(r, n, b.d, b.size);
+    sign = a.sign;
+  } else if (a.sign == 0) {
+    memcpy(r, b.d, sizeof(uint32_t) * b.size);
+    sign = b.sign;
+  } else if (big_cmp(a.d, a.size, b.d, b.size) >= 0) {
+    memcpy(r, a.d, sizeof(uint32_t) * a.size);
+    big_sub_into(r, n, b.d, b.size);
+    sign = a.sign;
+  } else {
+    memcpy(r, b.d, sizeof(uint32_t) * b.size);
+    big_sub_into(r, n, a.d, a.size);
+    sign = b.sign;
+  }
+
+  lval* v = lval_big(sign, r, n);
+  free(r);
+  return v;
+}
+
+lval* lval_big_mul(lval* x, lval* y) {
+  lbigview a, b;
+  lval_big_view(x, &a);
+  lval_big_view(y, &b);
+  if (!a.sign || !b.sign) { return lval_num(0); }
+
+  uint32_t* r = malloc(sizeof(uint32_t) * (a.size + b.size));
+  big_mul(r, a.d, a.size, b.d, b.size);
+  lval* v = lval_big(a.sign * b.sign, r, a.size + b.size);
+  free(r);
+  return v;
+}
+
+/* x / y rounded towards zero like C, for non-zero y */
+lval* lval_big_div(lval* x, lval* y) {
+  lbigview a, b;
+  lval_big_view(x, &a);
+  lval_big_view(y, &b);
+  if (big_cmp(a.d, a.size, b.d, b.size) < 0) { return lval_num(0); }
+
+  int n = a.size - b.size + 1;
+  uint32_t* q = malloc(sizeof(uint32_t) * a.size);
+  if (b.size == 1) {
+    big_div_small(q, a.d, a.size, b.d[0]);
+    n = a.size;
+  } else {
+    big_div(q, a.d, a.size, b.d, b.size);
+  }
+  lval* v = lval_big(a.sign * b.sign, q, n);
+  free(q);
+  return v;
+}
+
+/* Compares two numbers, returning -1, 0 or 1 */
+int lval_num_cmp(lval* x, lval* y) {
+  if (!LBIG(x) && !LBIG(y)) {
+    return (LNUM(x) > LNUM(y)) - (LNUM(x) < LNUM(y));
+  }
+
+  lbigview a, b;
+  lval_big_view(x, &a);
+  lval_big_view(y, &b);
+  if (a.sign != b.sign) { return (a.sign > b.sign) - (a.sign < b.sign); }
+  int c = big_cmp(a.d, a.size, b.d, b.size);
+  return a.sign < 0 ? -c : c;
+}
+
+/* Any number as a double, for arithmetic mixing integers and doubles */
+double lval_to_dbl(lval* v) {
+  if (LTYPE(v) == LVAL_DBL) { return v->dbl; }
+
+  lbig* b = LBIG(v);
+  if (!b) { return (double)LNUM(v); }
+
+  double x = 0;
+  for (int i = b->size - 1; i >= 0; i--) { x = x * 4294967296.0 + b->d[i]; }
+  return b->sign * x;
+}
+
+/* Decimal digits of a bignum, which the caller frees */
+char* lval_big_str(lval* v) {
+  int n = v->big->size;
+  uint32_t* t = malloc(sizeof(uint32_t) * n);
+  memcpy(t, v->big->d, sizeof(uint32_t) * n);
+
+  /* Split into groups of nine digits, least significant first */
+  uint32_t* groups = malloc(sizeof(uint32_t) * (n * 32 / 29 + 2));
+  int k = 0;
+  do {
+    groups[k++] = big_div_small(t, t, n, 1000000000);
+    n = big_trim(t, n);
+  } while (n);
+
+  char* s = malloc(10 * k + 2);
+  char* end = s;
+  if (v->big->sign < 0) { *end++ = '-'; }
+  end += sprintf(end, "%u", groups[k-1]);
+  for (int i = k - 2; i >= 0; i--) {
+    end += sprintf(end, "%09u", groups[i]);
+  }
+
+  free(groups);
+  free(t);
+  return s;
+}
+
+/* Reads a decimal integer of any length */
+lval* lval_big_read(char* s) {
+  int sign = 1;
+  if (*s == '-') { sign = -1; s++; }
+
+  int digits = strlen(s);
+  uint32_t* d = calloc(digits / 9 + 2, sizeof(uint32_t));
+  int n = 0;
+
+  /* Take nine digits at a time, with any left over first */
+  int len = digits % 9 ? digits % 9 : 9;
+  while (*s) {
+    uint32_t chunk = 0;
+    uint32_t scale = 1;
+    for (int i = 0; i < len; i++) {
+      chunk = chunk * 10 + (*s++ - '0');
+      scale *= 10;
+    }
+
+    uint64_t c = chunk;
+    for (int i = 0; i < n; i++) {
+      c += (uint64_t)d[i] * scale;
+      d[i] = (uint32_t)c;
+      c >>= 32;
+    }
+    if (c) { d[n++] = (uint32_t)c; }
+    len = 9;
+  }
+
+  lval* v = lval_big(sign, d, n);
+  free(d);
+  return v;
+}
+
+/* Construct a pointer to a new Error type lval */
+lval* lval_err(char* fmt, ...) {
+  lval* v = lval_new(LVAL_ERR);
+
+  /* Create a va list and initialize it */
+  va_list va;
+  va_start(va, fmt);
+
+  /* Allocate 512 bytes of space */
+  v->err = malloc(512);
+
+  /* printf the error string with a maximum of 511 characters */
+  vsnprintf(v->err, 511, fmt, va);
+
+  /* Reallocate to number of bytes actually used */
+  v->err = realloc(v->err, strlen(v->err)+1);
+
+  /* Cleanup our va list */
+  va_end(va);
+
+  return v;
+}
+
+/* Construct a pointer to a new Symbol type lval */
+lval* lval_sym(char* s) {
+  lval* v = lval_new(LVAL_SYM);
+  v->sym = sym_intern(s);
+
+  return v;
+}
+
+/* Construct a pointer to a new String type lval */
+lval* lval_str(char* s) {
+  lval* v = lval_new(LVAL_STR);
+  v->slen = strlen(s);
+  v->str = malloc(v->slen + 1);
+  v->buf = NULL;
+  strcpy(v->str, s);
+
+  return v;
+}
+
+void lstrbuf_del(lstrbuf* b) {
+  if (--b->refs > 0) { return; }
+  free(b->data);
+  free(b);
+}
+
+/* The characters of string 'v', which are not always terminated */
+char* lval_str_chars(lval* v) {
+  return v->buf ? v->buf->data : v->str;
+}
+
+/* The characters of string 'v' as a C string. Strings shorter than */
+/* their buffer are copied out of it first. */
+char* lval_cstr(lval* v) {
+  if (!v->buf) { return v->str; }
+  if (v->slen == v->buf->len) { return v->buf->data; }
+
+  v->str = malloc(v->slen + 1);
+  memcpy(v->str, v->buf->data, v->slen);
+  v->str[v->slen] = '\0';
+  lstrbuf_del(v->buf);
+  v->buf = NULL;
+  return v->str;
+}
+
+/* Makes 'x' a string with the same characters as 'v' */
+void lval_str_share(lval* x, lval* v) {
+  x->slen = v->slen;
+  x->buf = v->buf;
+  if (x->buf) {
+    x->buf->refs++;
+    x->str = NULL;
+  } else {
+    x->str = malloc(v->slen + 1);
+    memcpy(x->str, v->str, v->slen + 1);
+  }
+}
+
+void lval_str_free(lval* v) {
+  free(v->str);
+  if (v->buf) { lstrbuf_del(v->buf); }
+}
+
+/* Construct a pointer to a new empty Sexpr type lval */
+lval* lval_sexpr(void) {
+  lval* v = lval_new(LVAL_SEXPR);
+  v->count = 0;
+  v->cell = NULL;
+  v->base = NULL;
+
+  return v;
+}
+
+/* Construct a pointer to a new empty Qexpr lval */
+lval* lval_qexpr(void) {
+  lval* v = lval_new(LVAL_QEXPR);
+  v->count = 0;
+  v->cell = NULL;
+  v->base = NULL;
+  return v;
+}
+
+/* A list of the 'n' elements of 'v' from 'start', consuming 'v'. The */
+/* cells are shared rather than copied, lval_unshare copies them before */
+/* the slice is changed. */
+lval* lval_slice(lval* v, int start, int n) {
+  lval* x = lval_new(v->type);
+  x->count = n;
+  x->cell = n ? v->cell + start : NULL;
+  x->base = n ? lval_copy(v->base ? v->base : v) : NULL;
+  lval_del(v);
+  return x;
+}
+
+/* Construct a pointer to a new function type lval */
+lval* lval_fun(lbuiltin func) {
+  lval* v = lval_new(LVAL_FUN);
+  v->builtin = func;
+  v->memo = NULL;
+
+  return v;
+}
+
+/* Construct a pointer to a new lambda type lval */
+lval* lval_lambda(lval* formals, lval* body) {
+  lval* v = lval_new(LVAL_FUN);
+
+  /* Set builtin to Null */
+  v->builtin = NULL;
+  v->memo = NULL;
+
+  /* Build new environment */
+  v->env = lenv_new();
+
+  /* Set formals and body. Calls pop the formals, so they must not be */
+  /* shared with anything else. */
+  v->formals = lval_unshare(formals);
+  v->body = body;
+
+  /* Compile the body once so calls don't re-walk it */
+  v->code = use_vm ? lcode_compile(v->formals, body) : NULL;
+
+  return v;
+}
+
+void lmemo_del(lmemo* m) {
+  if (--m->refs > 0) { return; }
+
+  for (int i = 0; i < m->nsets * MEMO_WAYS; i++) {
+    if (m->entries[i].args) {
+      lval_del(m->entries[i].args);
+      lval_del(m->entries[i].val);
+    }
+  }
+  lval_del(m->fun);
+  free(m->entries);
+  free(m);
+}
+
+lvnode* vnode_new(void) {
+  lvnode* n = calloc(1, sizeof(lvnode));
+  n->refs = 1;
+  n->young = 1;
+  return n;
+}
+
+/* Drops a reference to node 'n' at height 'shift', releasing the values */
+/* in its leaves with 'drop' once it is unused */
+void vnode_del(lvnode* n, int shift, void (*drop)(lval*)) {
+  if (!n || --n->refs > 0) { return; }
+
+  for (int i = 0; i < VEC_WIDTH; i++) {
+    if (shift == 0 && n->vals[i]) { drop(n->vals[i]); }
+    if (shift > 0 && n->kids[i]) { vnode_del(n->kids[i], shift - VEC_BITS, drop); }
+  }
+  free(n);
+}
+
+/* Index of the first value in the tail */
+int lval_vec_tailoff(lval* v) {
+  return v->len < VEC_WIDTH ? 0 : ((v->len - 1) >> VEC_BITS) << VEC_BITS;
+}
+
+lval* lval_vec_get(lval* v, int i) {
+  if (i >= lval_vec_tailoff(v)) { return v->tail->vals[i & (VEC_WIDTH - 1)]; }
+
+  lvnode* n = v->root;
+  for (int level = v->shift; level > 0; level -= VEC_BITS) {
+    n = n->kids[(i >> level) & (VEC_WIDTH - 1)];
+  }
+  return n->vals[i & (VEC_WIDTH - 1)];
+}
+
+void lval_del(lval* v) {
+  if (LVAL_IS_FIXNUM(v)) { return; }
+
+  /* Only free once the last reference is gone */
+  if (--v->refs > 0) { return; }
+
+  /* Arena lvals are cleaned up when their region is closed */
+  if (v->gen == LGEN_ARENA) { return; }
+
+  /* Long lists are freed in a loop rather than by recursion */
+  while (v->type == LVAL_CONS) {
+    lval* cdr = v->cdr;
+    lval_del(v->car);
+    lval_free(v);
+    v = cdr;
+    if (LVAL_IS_FIXNUM(v) || --v->refs > 0 || v->gen == LGEN_ARENA) {
+      return;
+    }
+  }
+
+  switch (v->type) {
+    case LVAL_NUM: free(v->big); break;
+
+    case LVAL_FUN:;
+      if (v->memo) { lmemo_del(v->memo); }
       if (!v->builtin) {
         lenv_del(v->env);
         lval_del(v->formals);
         lval_del(v->body);
+        if (v->code) { lcode_del(v->code); }
       }
     break;
 
     /* For Err or Sym free the string data */
     case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
-    case LVAL_STR: free(v->str); break;
+    case LVAL_STR: lval_str_free(v); break;
 
     /* If Qexpr or Sexpr then delete all elements inside it */
     case LVAL_QEXPR:
     case LVAL_SEXPR:
+      if (v->base) { lval_del(v->base); break; }
       for (int i = 0; i < v->count; i++) {
         lval_del(v->cell[i]);
       }
       /* Also free the memory allocated to contain the pointers */
-      free(v->cell);
+      cells_free(v->cell, lval_capacity(v->count));
     break;
 
+    case LVAL_VEC:
+      vnode_del(v->root, v->shift, lval_del);
+      vnode_del(v->tail, 0, lval_del);
+    break;
+
+    case LVAL_ARR: free(v->ints); break;
+
   }
 
   /* Free the memory allocated for the lval struct itself */
-  free(v);
+  lval_free(v);
 }
 
 lval* lval_read_num(mpc_ast_t* t) {
   errno = 0;
   long x = strtol(t->contents, NULL, 10);
 
+  /* Literals too long for a long are read as bignums */
   if (errno != ERANGE) {
     return lval_num(x);
   } else {
-    return lval_err("invalid number");
+    return lval_big_read(t->contents);
   }
 }
 
+lval* lval_read_dbl(mpc_ast_t* t) {
+  return lval_dbl(strtod(t->contents, NULL));
+}
+
 lval* lval_read_str(mpc_ast_t* t) {
   /* Cut off the final quote character */
   t->contents[strlen(t->contents)-1] = '\0';
@@ -377,9 +1661,29 @@ lval* lval_read_str(mpc_ast_t* t) {
   return str;
 }
 
+/* Resizes the cell array of 'v' from 'from' to 'to' cells */
+void lval_resize(lval* v, int from, int to) {
+  lval** cell;
+
+  if (v->gen == LGEN_ARENA) {
+    /* Arena arrays are never freed, so only ever grow them */
+    if (to <= lval_capacity(from)) { return; }
+    cell = arena_alloc_bytes(sizeof(lval*) * lval_capacity(to));
+  } else {
+    /* Pooled arrays only move when they change size class */
+    if (lval_capacity(to) == lval_capacity(from)) { return; }
+    cell = to ? cells_alloc(lval_capacity(to)) : NULL;
+  }
+
+  int n = from < to ? from : to;
+  if (n) { memcpy(cell, v->cell, sizeof(lval*) * n); }
+  if (v->gen != LGEN_ARENA) { cells_free(v->cell, lval_capacity(from)); }
+  v->cell = cell;
+}
+
 lval* lval_add(lval* v, lval* x) {
+  lval_resize(v, v->count, v->count+1);
   v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
   v->cell[v->count-1] = x;
   return v;
 }
@@ -387,6 +1691,7 @@ lval* lval_add(lval* v, lval* x) {
 lval* lval_read(mpc_ast_t* t) {
   /* If Symbol or Number return conversion to that type */
   if (strstr(t->tag, "number")) { return lval_read_num(t); }
+  if (strstr(t->tag, "double")) { return lval_read_dbl(t); }
   if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
   if (strstr(t->tag, "string")) { return lval_read_str(t); }
 
@@ -432,8 +1737,8 @@ void lval_expr_print(lenv* e, lval* v, char open, char close) {
 
 void lval_print_str(lval* v) {
   /* make a copy of the string */
-  char* escaped = malloc(strlen(v->str) + 1);
-  strcpy(escaped, v->str);
+  char* escaped = malloc(v->slen + 1);
+  strcpy(escaped, lval_cstr(v));
 
   /* Pass it through the escape function */
   escaped = mpcf_escape(escaped);
@@ -445,14 +1750,40 @@ void lval_print_str(lval* v) {
   free(escaped);
 }
 
+/* Prints the shortest form that reads back as the same double, always */
+/* with a '.' or exponent so it doesn't read back as an integer */
+void lval_print_dbl(double x) {
+  char buf[32];
+  for (int digits = 15; digits <= 17; digits++) {
+    snprintf(buf, sizeof(buf), "%.*g", digits, x);
+    if (strtod(buf, NULL) == x) { break; }
+  }
+  if (!strpbrk(buf, ".eni")) { strcat(buf, ".0"); }
+  fputs(buf, stdout);
+}
+
 void lval_print(lenv* e, lval* v) {
-  switch (v->type) {
+  switch (LTYPE(v)) {
     /* In the case the type is a number print it */
     /* Then 'break' out of the switch. */
-    case LVAL_NUM: printf("%li", v->num); break;
+    case LVAL_NUM:
+      if (LBIG(v)) {
+        char* digits = lval_big_str(v);
+        fputs(digits, stdout);
+        free(digits);
+      } else {
+        printf("%li", LNUM(v));
+      }
+      break;
+
+    case LVAL_DBL: lval_print_dbl(v->dbl); break;
 
     case LVAL_FUN:;
-      if (v->builtin) {
+      if (v->memo) {
+        printf("(memo ");
+        lval_print(e, v->memo->fun);
+        putchar(')');
+      } else if (v->builtin) {
         char* fname = lenv_get_fname_from_builtin(e, v);
         printf("Function: %s", fname);
       } else {
@@ -471,6 +1802,44 @@ void lval_print(lenv* e, lval* v) {
     case LVAL_STR: lval_print_str(v); break;
     case LVAL_SEXPR: lval_expr_print(e, v, '(', ')'); break;
     case LVAL_QEXPR: lval_expr_print(e, v, '{', '}'); break;
+
+    case LVAL_CONS:
+      putchar('<');
+      lval_print(e, v->car);
+      while (LTYPE(v->cdr) == LVAL_CONS) {
+        v = v->cdr;
+        putchar(' ');
+        lval_print(e, v->car);
+      }
+      /* Lists normally end in {}, anything else is shown after a dot */
+      if (LTYPE(v->cdr) != LVAL_QEXPR || v->cdr->count) {
+        printf(" . ");
+        lval_print(e, v->cdr);
+      }
+      putchar('>');
+      break;
+
+    case LVAL_VEC:
+      putchar('[');
+      for (int i = 0; i < v->len; i++) {
+        if (i) { putchar(' '); }
+        lval_print(e, lval_vec_get(v, i));
+      }
+      putchar(']');
+      break;
+
+    case LVAL_ARR:
+      printf("#[");
+      for (int i = 0; i < v->alen; i++) {
+        if (i) { putchar(' '); }
+        if (v->adbl) {
+          lval_print_dbl(v->dbls[i]);
+        } else {
+          printf("%li", v->ints[i]);
+        }
+      }
+      putchar(']');
+      break;
   }
 }
 
@@ -482,52 +1851,111 @@ lval* lval_pop(lval* v, int i);
 lval* lval_eval(lenv* e, lval* v);
 lval* lval_call(lenv* e, lval* f, lval* a);
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
+lval* builtin_if(lenv* e, lval* a);
+lval* builtin_memo(lenv* e, lval* a);
+lval* builtin_eval(lenv* e, lval* a);
+lval* lval_if_branch(lval* a);
+lval* lval_eval_arg(lval* a);
+lval* lval_bind(lenv* e, lval* f, lval* a);
+lenv* lval_enter_tail(lenv* e, lval* f, lval** frames);
+lval* lcode_run(lenv* e, lcode* c);
 
-  /* Evaluate the children */
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
-  }
+lval* lval_eval(lenv* e, lval* v) {
+  /* Functions entered by tail calls, which own their environments */
+  lval* frames = NULL;
+  eval_depth++;
+
+  /* Calls in tail position loop here instead of recursing */
+  while (1) {
+    /* Evaluate Symbols */
+    if (LTYPE(v) == LVAL_SYM) {
+      lval* x = lenv_get(e, v);
+      lval_del(v);
+      v = x;
+      break;
+    }
 
-  /* Error checking */
-  for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
-  }
+    /* All other lval types except S-Expressions remain the same */
+    if (LTYPE(v) != LVAL_SEXPR) { break; }
 
-  /* Empty expression */
-  if (v->count == 0) { return v; }
+    /* The children are replaced by their values below */
+    v = lval_unshare(v);
 
-  /* Single expression */
-  if (v->count == 1) { return lval_take(v, 0); }
+    /* Evaluate the children */
+    for (int i = 0; i < v->count; i++) {
+      v->cell[i] = lval_eval(e, v->cell[i]);
+    }
 
-  /* Ensure first element is a function after evaluation */
-  lval* f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN) {
-    lval* err = lval_err(
-        "S-Expression starts with incorrect type. "
-        "Got %s, expected %s.",
-        ltype_name(f->type), ltype_name(LVAL_FUN));
-    lval_del(v);
-    lval_del(f);
-    return err;
-  }
+    /* Error checking */
+    int err = -1;
+    for (int i = 0; i < v->count && err == -1; i++) {
+      if (LTYPE(v->cell[i]) == LVAL_ERR) { err = i; }
+    }
+    if (err != -1) { v = lval_take(v, err); break; }
+
+    /* Empty expression */
+    if (v->count == 0) { break; }
+
+    /* Single expression */
+    if (v->count == 1) { v = lval_take(v, 0); break; }
+
+    /* Ensure first element is a function after evaluation */
+    lval* f = lval_pop(v, 0);
+    if (LTYPE(f) != LVAL_FUN) {
+      lval* err = lval_err(
+          "S-Expression starts with incorrect type. "
+          "Got %s, expected %s.",
+          ltype_name(LTYPE(f)), ltype_name(LVAL_FUN));
+      lval_del(v);
+      lval_del(f);
+      v = err;
+      break;
+    }
 
-  lval* result = lval_call(e, f, v);
+    /* Memoized functions look up their arguments first */
+    if (f->memo) {
+      v = lval_call(e, f, v);
+      break;
+    }
 
-  return result;
-}
+    /* 'if' and 'eval' evaluate their expression in this same loop */
+    if (f->builtin == builtin_if || f->builtin == builtin_eval) {
+      v = (f->builtin == builtin_if) ? lval_if_branch(v) : lval_eval_arg(v);
+      lval_del(f);
+      continue;
+    }
 
-lval* lval_eval(lenv* e, lval* v) {
-  /* Evaluate S-expressions */
-  if (v->type == LVAL_SYM) {
-    lval* x = lenv_get(e, v);
-    lval_del(v);
-    return x;
-  }
+    if (f->builtin) {
+      v = f->builtin(e, v);
+      lval_del(f);
+      break;
+    }
+
+    /* Bind the arguments, stopping on errors or partial application */
+    f = lval_unshare(f);
+    lval* x = lval_bind(e, f, v);
+    if (x) {
+      lval_del(f);
+      v = x;
+      break;
+    }
+
+    /* Compiled bodies handle their own tail calls */
+    if (f->code) {
+      f->env->parent = e;
+      v = lcode_run(f->env, f->code);
+      lval_del(f);
+      break;
+    }
 
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
+    /* Otherwise continue with the body in the function's environment */
+    e = lval_enter_tail(e, f, &frames);
+    v = lval_unshare(lval_copy(f->body));
+    v->type = LVAL_SEXPR;
+  }
 
-  /* All other lval types remain the same */
+  if (frames) { lval_del(frames); }
+  eval_depth--;
   return v;
 }
 
@@ -543,7 +1971,7 @@ lval* lval_pop(lval* v, int i) {
   v->count--;
 
   /* Reallocate the memory used */
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  lval_resize(v, v->count+1, v->count);
 
   return x;
 }
@@ -562,9 +1990,9 @@ lval* lval_take(lval* v, int i) {
   }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
+  LASSERT(args, LTYPE(args->cell[index]) == expect, \
     "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+    func, index, ltype_name(LTYPE(args->cell[index])), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num) \
   LASSERT(args, args->count == num, \
@@ -575,130 +2003,275 @@ lval* lval_take(lval* v, int i) {
   LASSERT(args, args->cell[index]->count != 0, \
     "Function '%s' passed {} for argument %i.", func, index);
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
-  /* Ensure all the arguments are numbers */
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE(op, a, i, LVAL_NUM);
-  }
-
-  /* Pop the first element */
-  lval* x = lval_pop(a, 0);
+#define LASSERT_NUMERIC(func, args, index) \
+  LASSERT(args, LTYPE(args->cell[index]) == LVAL_NUM \
+    || LTYPE(args->cell[index]) == LVAL_DBL, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s or %s.", \
+    func, index, ltype_name(LTYPE(args->cell[index])), \
+    ltype_name(LVAL_NUM), ltype_name(LVAL_DBL))
 
-  /* If no arguments and sub then perform unary negation */
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -(x->num);
-  }
-
-  /* While there are still elements remaining */
-  while (a->count > 0) {
-    /* Pop the next element */
-    lval* y = lval_pop(a, 0);
-
-    if (strcmp(op, "+") == 0) { x->num += y->num; }
-    if (strcmp(op, "-") == 0) { x->num -= y->num; }
-    if (strcmp(op, "*") == 0) { x->num *= y->num; }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division by zero!");
-        break;
-      } else {
-        x->num /= y->num;
-      }
-    }
+#define LASSERT_NUMS(func, args) \
+  for (int i = 0; i < args->count; i++) { \
+    LASSERT_NUMERIC(func, args, i); \
+  }
 
-    lval_del(y);
+#define LASSERT_ORD(func, args) \
+  LASSERT_NUM(func, args, 2); \
+  LASSERT_NUMERIC(func, args, 0); \
+  LASSERT_NUMERIC(func, args, 1);
+
+#define LASSERT_LOGIC(func, args) \
+  LASSERT_NUM(func, args, 2); \
+  LASSERT_TYPE(func, args, 0, LVAL_NUM); \
+  LASSERT_TYPE(func, args, 1, LVAL_NUM);
+
+/* Results too wide for a fixnum are stored in the first argument when */
+/* nothing else refers to it, instead of allocating */
+lval* lval_num_result(lval* a, long x) {
+  lval* v = a->cell[0];
+  if (!lval_fixnum_fits(x) && !LVAL_IS_FIXNUM(v) && v->refs == 1 && !v->big) {
+    v = lval_copy(v);
+    lval_del(a);
+    v->num = x;
+    return v;
   }
 
   lval_del(a);
-
-  return x;
+  return lval_num(x);
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
-}
+/* Double results are likewise stored in a Double first argument */
+lval* lval_dbl_result(lval* a, double x) {
+  lval* v = a->cell[0];
+  if (LTYPE(v) == LVAL_DBL && v->refs == 1) {
+    v = lval_copy(v);
+    lval_del(a);
+    v->dbl = x;
+    return v;
+  }
 
-lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+  lval_del(a);
+  return lval_dbl(x);
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
+/* x op y on longs, returning 0 instead if the result doesn't fit */
+int lval_long_op(long x, long y, char op, long* r) {
+  switch (op) {
+    case '+': return !__builtin_add_overflow(x, y, r);
+    case '-': return !__builtin_sub_overflow(x, y, r);
+    case '*': return !__builtin_mul_overflow(x, y, r);
+    case '/':
+      if (x == LONG_MIN && y == -1) { return 0; }
+      *r = x / y;
+      return 1;
+  }
+  return 0;
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
+double lval_dbl_op(double x, double y, char op) {
+  switch (op) {
+    case '+': return x + y;
+    case '-': return x - y;
+    case '*': return x * y;
+    default:  return x / y;
+  }
 }
 
-lval* builtin_not(lenv* e, lval* a) {
-  LASSERT_NUM("!", a, 1);
-  LASSERT_TYPE("!", a, 0, LVAL_NUM);
+/* x op y on numbers of any size, or on doubles if either is one. */
+/* Integer divisors are checked by the caller, dividing a double by */
+/* zero gives an infinity or NaN. */
+lval* lval_num_op(lval* x, lval* y, char op) {
+  if (LTYPE(x) == LVAL_DBL || LTYPE(y) == LVAL_DBL) {
+    return lval_dbl(lval_dbl_op(lval_to_dbl(x), lval_to_dbl(y), op));
+  }
 
-  int r = !(a->cell[0]->num);
-  lval_del(a);
-  return lval_num(r);
+  long r;
+  if (!LBIG(x) && !LBIG(y) && lval_long_op(LNUM(x), LNUM(y), op, &r)) {
+    return lval_num(r);
+  }
+
+  switch (op) {
+    case '+': return lval_big_add(x, y, 1);
+    case '-': return lval_big_add(x, y, -1);
+    case '*': return lval_big_mul(x, y);
+    default:  return lval_big_div(x, y);
+  }
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-  LASSERT_NUM(op, a, 2);
-  LASSERT_TYPE(op, a, 0, LVAL_NUM);
-  LASSERT_TYPE(op, a, 1, LVAL_NUM);
+/* Applies op to the arguments left to right. This stays on longs until */
+/* a result overflows or a bignum or double argument is met. */
+lval* lval_num_fold(lval* a, char op) {
+  lval* x = LVAL_IS_LONG(a->cell[0]) ? NULL : lval_copy(a->cell[0]);
+  long acc = x ? 0 : LNUM(a->cell[0]);
+
+  for (int i = 1; i < a->count; i++) {
+    lval* y = a->cell[i];
+    int dbl = LTYPE(y) == LVAL_DBL || (x && LTYPE(x) == LVAL_DBL);
+    if (op == '/' && !dbl && LNUM(y) == 0) {
+      if (x) { lval_del(x); }
+      lval_del(a);
+      return lval_err("Division by zero!");
+    }
 
-  int r;
+    long r;
+    if (!x) {
+      if (LVAL_IS_LONG(y) && lval_long_op(acc, LNUM(y), op, &r)) {
+        acc = r;
+        continue;
+      }
+      x = lval_num(acc);
+    }
 
-  if (strcmp(op, ">") == 0) {
-    r = (a->cell[0]->num > a->cell[1]->num);
+    lval* z = lval_num_op(x, y, op);
+    lval_del(x);
+    x = z;
   }
 
-  if (strcmp(op, "<") == 0) {
-    r = (a->cell[0]->num < a->cell[1]->num);
+  if (!x) { return lval_num_result(a, acc); }
+  lval_del(a);
+  return x;
+}
+
+/* The common two argument cases of each operator, two longs that can't */
+/* overflow or two doubles, are handled before the general loop */
+lval* builtin_add(lenv* e, lval* a) {
+  LASSERT_NUMS("+", a);
+
+  if (a->count == 2) {
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    long r;
+    if (LVAL_IS_LONG(x) && LVAL_IS_LONG(y)
+        && !__builtin_add_overflow(LNUM(x), LNUM(y), &r)) {
+      return lval_num_result(a, r);
+    }
+    if (LTYPE(x) == LVAL_DBL && LTYPE(y) == LVAL_DBL) {
+      return lval_dbl_result(a, x->dbl + y->dbl);
+    }
   }
 
-  if (strcmp(op, ">=") == 0) {
-    r = (a->cell[0]->num >= a->cell[1]->num);
+  return lval_num_fold(a, '+');
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+  LASSERT_NUMS("-", a);
+
+  if (a->count == 2) {
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    long r;
+    if (LVAL_IS_LONG(x) && LVAL_IS_LONG(y)
+        && !__builtin_sub_overflow(LNUM(x), LNUM(y), &r)) {
+      return lval_num_result(a, r);
+    }
+    if (LTYPE(x) == LVAL_DBL && LTYPE(y) == LVAL_DBL) {
+      return lval_dbl_result(a, x->dbl - y->dbl);
+    }
   }
 
-  if (strcmp(op, "<=") == 0) {
-    r = (a->cell[0]->num <= a->cell[1]->num);
+  /* If no arguments and sub then perform unary negation */
+  if (a->count == 1) {
+    if (LTYPE(a->cell[0]) == LVAL_DBL) {
+      return lval_dbl_result(a, -a->cell[0]->dbl);
+    }
+    lval* z = lval_num(0);
+    lval* r = lval_num_op(z, a->cell[0], '-');
+    lval_del(z);
+    lval_del(a);
+    return r;
   }
 
-  if (strcmp(op, "&&") == 0) {
-    r = (a->cell[0]->num && a->cell[1]->num);
+  return lval_num_fold(a, '-');
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+  LASSERT_NUMS("*", a);
+
+  if (a->count == 2) {
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    long r;
+    if (LVAL_IS_LONG(x) && LVAL_IS_LONG(y)
+        && !__builtin_mul_overflow(LNUM(x), LNUM(y), &r)) {
+      return lval_num_result(a, r);
+    }
+    if (LTYPE(x) == LVAL_DBL && LTYPE(y) == LVAL_DBL) {
+      return lval_dbl_result(a, x->dbl * y->dbl);
+    }
   }
 
-  if (strcmp(op, "||") == 0) {
-    r = (a->cell[0]->num || a->cell[1]->num);
+  return lval_num_fold(a, '*');
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+  LASSERT_NUMS("/", a);
+
+  if (a->count == 2) {
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    if (LTYPE(x) == LVAL_DBL && LTYPE(y) == LVAL_DBL) {
+      return lval_dbl_result(a, x->dbl / y->dbl);
+    }
   }
 
-  lval_del(a);
+  return lval_num_fold(a, '/');
+}
+
+lval* builtin_not(lenv* e, lval* a) {
+  LASSERT_NUM("!", a, 1);
+  LASSERT_TYPE("!", a, 0, LVAL_NUM);
 
+  int r = !(LNUM(a->cell[0]));
+  lval_del(a);
   return lval_num(r);
 }
 
+/* Compares two numbers with a C operator, as doubles if either is one */
+#define LVAL_NUM_ORD(x, y, op) \
+  (LTYPE(x) == LVAL_DBL || LTYPE(y) == LVAL_DBL \
+    ? lval_to_dbl(x) op lval_to_dbl(y) \
+    : lval_num_cmp(x, y) op 0)
+
 lval* builtin_gt(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">");
+  LASSERT_ORD(">", a);
+  int r = LVAL_NUM_ORD(a->cell[0], a->cell[1], >);
+  lval_del(a);
+  return lval_num(r);
 }
 
 lval* builtin_lt(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<");
+  LASSERT_ORD("<", a);
+  int r = LVAL_NUM_ORD(a->cell[0], a->cell[1], <);
+  lval_del(a);
+  return lval_num(r);
 }
 
 lval* builtin_ge(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">=");
+  LASSERT_ORD(">=", a);
+  int r = LVAL_NUM_ORD(a->cell[0], a->cell[1], >=);
+  lval_del(a);
+  return lval_num(r);
 }
 
 lval* builtin_le(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<=");
+  LASSERT_ORD("<=", a);
+  int r = LVAL_NUM_ORD(a->cell[0], a->cell[1], <=);
+  lval_del(a);
+  return lval_num(r);
 }
 
 lval* builtin_and(lenv* e, lval* a) {
-  return builtin_ord(e, a, "&&");
+  LASSERT_LOGIC("&&", a);
+  int r = (LNUM(a->cell[0]) && LNUM(a->cell[1]));
+  lval_del(a);
+  return lval_num(r);
 }
 
 lval* builtin_or(lenv* e, lval* a) {
-  return builtin_ord(e, a, "||");
+  LASSERT_LOGIC("||", a);
+  int r = (LNUM(a->cell[0]) || LNUM(a->cell[1]));
+  lval_del(a);
+  return lval_num(r);
 }
 
 lval* builtin_head(lenv* e, lval* a) {
@@ -709,10 +2282,12 @@ lval* builtin_head(lenv* e, lval* a) {
   /* Otherwise, take first argument */
   lval* v = lval_take(a, 0);
 
-  /* Delete all elements that are not head and return */
-  while (v->count > 1) { lval_del(lval_pop(v,1)); }
+  /* Build a list of just the head rather than copying and emptying */
+  /* the rest of it */
+  lval* x = lval_add(lval_qexpr(), lval_copy(v->cell[0]));
+  lval_del(v);
 
-  return v;
+  return x;
 }
 
 lval* builtin_tail(lenv* e, lval* a) {
@@ -723,10 +2298,8 @@ lval* builtin_tail(lenv* e, lval* a) {
   /* Otherwise, take first argument */
   lval* v = lval_take(a, 0);
 
-  /* Delete first element and return */
-  lval_del(lval_pop(v,0));
-
-  return v;
+  /* Return the rest of it without copying */
+  return lval_slice(v, 1, v->count - 1);
 }
 
 lval* builtin_list(lenv* e, lval* a) {
@@ -742,9 +2315,9 @@ lval* builtin_lambda(lenv* e, lval* a) {
 
   /* Check first Q-Expr contains only symbols */
   for (int i = 0; i < a->cell[0]->count; i++) {
-    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+    LASSERT(a, (LTYPE(a->cell[0]->cell[i]) == LVAL_SYM),
       "Cannot define non-symbol. Got %s, Expected %s.",
-      ltype_name(a->cell[0]->cell[i]->type),ltype_name(LVAL_SYM));
+      ltype_name(LTYPE(a->cell[0]->cell[i])),ltype_name(LVAL_SYM));
   }
 
   /* Pop first two arguments and pass them to lval_lambda */
@@ -756,22 +2329,27 @@ lval* builtin_lambda(lenv* e, lval* a) {
 }
 
 lval* lval_join(lval* x, lval* y) {
-  /* For each cell in 'y' add it to 'x' */
-  while (y->count) {
-    x = lval_add(x, lval_pop(y, 0));
+  /* For each cell in 'y' add a copy of it to 'x' */
+  for (int i = 0; i < y->count; i++) {
+    x = lval_add(x, lval_copy(y->cell[i]));
   }
-  /* Delete the empty 'y' and return 'x' */
+  /* Delete 'y' and return 'x' */
   lval_del(y);
   return x;
 }
 
-lval* builtin_eval(lenv* e, lval* a) {
+/* Checks the arguments of 'eval' and returns the expression to evaluate */
+lval* lval_eval_arg(lval* a) {
   LASSERT_NUM("eval", a, 1);
   LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
 
-  lval* x = lval_take(a, 0);
+  lval* x = lval_unshare(lval_take(a, 0));
   x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
+  return x;
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+  return lval_eval(e, lval_eval_arg(a));
 }
 
 lval* builtin_join_qexpr(lenv* e, lval* a) {
@@ -779,7 +2357,7 @@ lval* builtin_join_qexpr(lenv* e, lval* a) {
     LASSERT_TYPE("join", a, i, LVAL_QEXPR);
   }
 
-  lval* x = lval_pop(a, 0);
+  lval* x = lval_unshare(lval_pop(a, 0));
 
   while (a->count) {
     x = lval_join(x, lval_pop(a, 0));
@@ -794,34 +2372,247 @@ lval* builtin_join_str(lenv* e, lval* a) {
     LASSERT_TYPE("join", a, i, LVAL_STR);
   }
 
-  lval* x = lval_pop(a, 0);
+  /* Work out the length of the result */
+  size_t len = 0;
+  for (int i = 0; i < a->count; i++) {
+    len += a->cell[i]->slen;
+  }
 
-  while (a->count) {
-    lval* y = lval_pop(a, 0);
-    char* concatted = malloc(strlen(x->str) + strlen(y->str) + 1);
-    concatted = strcat(x->str, y->str);
-    x = lval_str(concatted);
+  lval* x = lval_new(LVAL_STR);
+  x->slen = len;
+  x->str = NULL;
+  x->buf = NULL;
+  int from = 0;
+  char* end;
+
+  if (len < STR_BUF_MIN) {
+    /* Short strings are copied */
+    x->str = malloc(len + 1);
+    end = x->str;
+  } else {
+    /* Otherwise append to the first string's buffer if it is as long */
+    /* as it, or start a new buffer with room to grow */
+    lval* y = a->cell[0];
+    if (y->buf && y->slen == y->buf->len) {
+      x->buf = y->buf;
+      x->buf->refs++;
+      from = 1;
+    } else {
+      x->buf = malloc(sizeof(lstrbuf));
+      x->buf->refs = 1;
+      x->buf->len = 0;
+      x->buf->cap = 0;
+      x->buf->data = NULL;
+    }
+
+    lstrbuf* b = x->buf;
+    if (len + 1 > b->cap) {
+      b->cap = len + 1 > b->cap * 2 ? len + 1 : b->cap * 2;
+      b->data = realloc(b->data, b->cap);
+    }
+    end = b->data + b->len;
+    b->len = len;
+  }
 
-    free(concatted);
-    free(y);
+  /* Copy each string in after the previous one */
+  for (int i = from; i < a->count; i++) {
+    memcpy(end, lval_str_chars(a->cell[i]), a->cell[i]->slen);
+    end += a->cell[i]->slen;
   }
+  *end = '\0';
 
   lval_del(a);
   return x;
 }
 
 lval* builtin_join(lenv* e, lval* a) {
-  lval* x = malloc(sizeof(lval));
-
   /* Switches based on the first cell's type */
-  switch(a->cell[0]->type) {
-    case LVAL_QEXPR: x = builtin_join_qexpr(e, a); break;
-    case LVAL_STR: x = builtin_join_str(e, a); break;
+  switch(LTYPE(a->cell[0])) {
+    case LVAL_STR: return builtin_join_str(e, a);
+
+    /* Anything else is reported as not being a Q-Expression */
+    default: return builtin_join_qexpr(e, a);
+  }
+}
+
+/* Native versions of the list functions in standard-library.lispy, */
+/* which loop over the cells instead of recursing on copies of the tail. */
+/* Elements are evaluated before being used, as 'first' does there. */
+lval* lval_list_item(lenv* e, lval* l, int i) {
+  return lval_eval(e, lval_copy(l->cell[i]));
+}
+
+/* Calls f with one or two arguments, consuming them */
+lval* lval_list_apply(lenv* e, lval* f, lval* x, lval* y) {
+  if (LTYPE(x) == LVAL_ERR) {
+    if (y) { lval_del(y); }
+    return x;
+  }
+  if (y && LTYPE(y) == LVAL_ERR) {
+    lval_del(x);
+    return y;
+  }
+
+  lval* a = lval_add(lval_sexpr(), x);
+  if (y) { a = lval_add(a, y); }
+  return lval_call(e, lval_copy(f), a);
+}
+
+#define LASSERT_LIST_INDEX(func, args, l, n) \
+  LASSERT(args, n >= 0 && n < l->count, \
+    "Function '%s' passed index %li, List has length %i.", \
+    func, n, l->count)
+
+#define LASSERT_LIST_COUNT(func, args, l, n) \
+  LASSERT(args, n >= 0 && n <= l->count, \
+    "Function '%s' passed count %li, List has length %i.", \
+    func, n, l->count)
+
+lval* builtin_map(lenv* e, lval* a) {
+  LASSERT_NUM("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUN);
+  LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  lval* r = lval_qexpr();
+  for (int i = 0; i < l->count; i++) {
+    lval* x = lval_list_apply(e, f, lval_list_item(e, l, i), NULL);
+    if (LTYPE(x) == LVAL_ERR) {
+      lval_del(r);
+      lval_del(a);
+      return x;
+    }
+    r = lval_add(r, x);
+  }
+  lval_del(a);
+  return r;
+}
+
+/* Keeps the elements themselves, not their values, like 'head' */
+lval* builtin_filter(lenv* e, lval* a) {
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+  LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  lval* r = lval_qexpr();
+  for (int i = 0; i < l->count; i++) {
+    lval* x = lval_list_apply(e, f, lval_list_item(e, l, i), NULL);
+    if (LTYPE(x) != LVAL_NUM) {
+      lval* err = LTYPE(x) == LVAL_ERR ? x : lval_err(
+        "Function 'filter' got %s from its predicate, Expected %s.",
+        ltype_name(LTYPE(x)), ltype_name(LVAL_NUM));
+      if (err != x) { lval_del(x); }
+      lval_del(r);
+      lval_del(a);
+      return err;
+    }
+    if (LNUM(x)) { r = lval_add(r, lval_copy(l->cell[i])); }
+    lval_del(x);
+  }
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_foldl(lenv* e, lval* a) {
+  LASSERT_NUM("foldl", a, 3);
+  LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+  LASSERT_TYPE("foldl", a, 2, LVAL_QEXPR);
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[2];
+  lval* z = lval_copy(a->cell[1]);
+  for (int i = 0; i < l->count && LTYPE(z) != LVAL_ERR; i++) {
+    z = lval_list_apply(e, f, z, lval_list_item(e, l, i));
+  }
+  lval_del(a);
+  return z;
+}
+
+lval* builtin_length(lenv* e, lval* a) {
+  LASSERT_NUM("length", a, 1);
+  LASSERT_TYPE("length", a, 0, LVAL_QEXPR);
+
+  int n = a->cell[0]->count;
+  lval_del(a);
+  return lval_num(n);
+}
+
+lval* builtin_reverse(lenv* e, lval* a) {
+  LASSERT_NUM("reverse", a, 1);
+  LASSERT_TYPE("reverse", a, 0, LVAL_QEXPR);
+
+  lval* l = a->cell[0];
+  lval* r = lval_qexpr();
+  for (int i = l->count - 1; i >= 0; i--) {
+    r = lval_add(r, lval_copy(l->cell[i]));
   }
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+  long n = LNUM(a->cell[0]);
+  LASSERT_LIST_INDEX("nth", a, a->cell[1], n);
+
+  lval* x = lval_list_item(e, a->cell[1], n);
+  lval_del(a);
+  return x;
+}
 
+lval* builtin_last(lenv* e, lval* a) {
+  LASSERT_NUM("last", a, 1);
+  LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("last", a, 0);
+
+  lval* x = lval_list_item(e, a->cell[0], a->cell[0]->count - 1);
+  lval_del(a);
   return x;
 }
 
+/* take and drop share the list rather than copying, like 'tail' */
+lval* builtin_take(lenv* e, lval* a) {
+  LASSERT_NUM("take", a, 2);
+  LASSERT_TYPE("take", a, 0, LVAL_NUM);
+  LASSERT_TYPE("take", a, 1, LVAL_QEXPR);
+  long n = LNUM(a->cell[0]);
+  LASSERT_LIST_COUNT("take", a, a->cell[1], n);
+
+  return lval_slice(lval_take(a, 1), 0, n);
+}
+
+lval* builtin_drop(lenv* e, lval* a) {
+  LASSERT_NUM("drop", a, 2);
+  LASSERT_TYPE("drop", a, 0, LVAL_NUM);
+  LASSERT_TYPE("drop", a, 1, LVAL_QEXPR);
+  long n = LNUM(a->cell[0]);
+  LASSERT_LIST_COUNT("drop", a, a->cell[1], n);
+
+  lval* l = lval_take(a, 1);
+  return lval_slice(l, n, l->count - n);
+}
+
+/* (native {map}), whether a symbol is bound to a builtin function. The */
+/* standard library uses it to skip its own versions of these. */
+lval* builtin_native(lenv* e, lval* a) {
+  LASSERT_NUM("native", a, 1);
+  LASSERT_TYPE("native", a, 0, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->count == 1
+    && LTYPE(a->cell[0]->cell[0]) == LVAL_SYM,
+    "Function 'native' passed a list that isn't a single Symbol.");
+
+  lval* x = lenv_get(e, a->cell[0]->cell[0]);
+  int r = LTYPE(x) == LVAL_FUN && x->builtin && !x->memo;
+  lval_del(x);
+  lval_del(a);
+  return lval_num(r);
+}
+
 lval* builtin_var(lenv* e, lval* a, char* func) {
   LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
 
@@ -830,11 +2621,11 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
 
   /* Ensure all elements of first list are symbols */
   for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, syms->cell[i]->type == LVAL_SYM,
+    LASSERT(a, LTYPE(syms->cell[i]) == LVAL_SYM,
         "Function '%s' cannot define non-symbol. "
         "Got %s, expected %s.",
         func,
-        ltype_name(syms->cell[i]->type),
+        ltype_name(LTYPE(syms->cell[i])),
         ltype_name(LVAL_SYM));
   }
 
@@ -868,28 +2659,38 @@ lval* builtin_put(lenv* e, lval* a) {
   return builtin_var(e, a, "=");
 }
 
-int lval_eq(lval* x, lval* y) {
+/* Set 'exact' to tell integers from the doubles they equal, as memo */
+/* must so that a call on a double doesn't get an integer result */
+int lval_equal(lval* x, lval* y, int exact) {
 
-  /* Different types are always unequal */
-  if (x->type != y->type) { return 0; }
+  /* Different types are unequal, but for an integer and a double, */
+  /* which are compared as doubles just as the orderings do */
+  if (LTYPE(x) != LTYPE(y)) {
+    int nums = (LTYPE(x) == LVAL_NUM || LTYPE(x) == LVAL_DBL)
+      && (LTYPE(y) == LVAL_NUM || LTYPE(y) == LVAL_DBL);
+    return nums && !exact && LVAL_NUM_ORD(x, y, ==);
+  }
 
   /* Compare based upon type */
-  switch(x->type) {
+  switch(LTYPE(x)) {
     /* Compare number values */
-    case LVAL_NUM: return (x->num == y->num);
+    case LVAL_NUM: return lval_num_cmp(x, y) == 0;
+    case LVAL_DBL: return x->dbl == y->dbl;
 
     /* Compare string values */
     case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-    case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-    case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+    case LVAL_SYM: return (x->sym == y->sym);
+    case LVAL_STR:
+      return x->slen == y->slen
+        && memcmp(lval_str_chars(x), lval_str_chars(y), x->slen) == 0;
 
     /* If builtin fn compare, otherwise compare formals and body */
     case LVAL_FUN:;
       if (x->builtin || y->builtin) {
-        return x->builtin == y->builtin;
+        return x->builtin == y->builtin && x->memo == y->memo;
       } else {
-        return lval_eq(x->formals, y->formals) &&
-          lval_eq(x->body, y->body);
+        return lval_equal(x->formals, y->formals, exact) &&
+          lval_equal(x->body, y->body, exact);
       }
 
     /* If list compare every individual element */
@@ -898,63 +2699,145 @@ int lval_eq(lval* x, lval* y) {
       if (x->count != y->count) { return 0; }
       for (int i = 0; i < x->count; i++) {
         /* If any element not equal then the whole list not equal */
-        if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
+        if (!lval_equal(x->cell[i], y->cell[i], exact)) { return 0; }
       }
 
       /* Otherwise lists must be equal */
       return 1;
     break;
+
+    case LVAL_CONS:
+      while (LTYPE(x) == LVAL_CONS && LTYPE(y) == LVAL_CONS) {
+        if (!lval_equal(x->car, y->car, exact)) { return 0; }
+        x = x->cdr;
+        y = y->cdr;
+      }
+      return lval_equal(x, y, exact);
+
+    case LVAL_VEC:
+      if (x->len != y->len) { return 0; }
+      for (int i = 0; i < x->len; i++) {
+        lval* xi = lval_vec_get(x, i);
+        lval* yi = lval_vec_get(y, i);
+        if (!lval_equal(xi, yi, exact)) { return 0; }
+      }
+      return 1;
+
+    case LVAL_ARR:
+      if (x->alen != y->alen || x->adbl != y->adbl) { return 0; }
+      for (int i = 0; i < x->alen; i++) {
+        if (x->adbl ? x->dbls[i] != y->dbls[i] : x->ints[i] != y->ints[i]) {
+          return 0;
+        }
+      }
+      return 1;
   }
   return 0;
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-  LASSERT_NUM(op, a, 2);
+int lval_eq(lval* x, lval* y) {
+  return lval_equal(x, y, 0);
+}
 
-  int r;
-  if (strcmp(op, "==") == 0) {
-    r = lval_eq(a->cell[0], a->cell[1]);
-  }
-  if (strcmp(op, "!=") == 0) {
-    r = !lval_eq(a->cell[0], a->cell[1]);
+/* Whole doubles hash as the integer they equal, which also hashes 0.0 */
+/* and -0.0 the same. Their low bits are all zero otherwise. */
+size_t lval_dbl_hash(double x) {
+  if (x >= -0x1p63 && x < 0x1p63 && x == (double)(long)x) {
+    return (size_t)(long)x * 2654435761u;
   }
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  return (size_t)(bits ^ (bits >> 32)) * 2654435761u;
+}
 
-  lval_del(a);
-  return lval_num(r);
+/* Hash consistent with lval_eq, values it finds equal hash the same. */
+/* Integers hash as the double they are compared as. */
+size_t lval_hash(lval* v) {
+  switch (LTYPE(v)) {
+    case LVAL_NUM:
+    case LVAL_DBL: return lval_dbl_hash(lval_to_dbl(v));
+    case LVAL_ERR: return sym_hash(v->err);
+    case LVAL_SYM: return (size_t)v->sym;
+    case LVAL_STR:;
+      char* c = lval_str_chars(v);
+      size_t hs = 2166136261u;
+      for (size_t i = 0; i < v->slen; i++) {
+        hs = (hs ^ (unsigned char)c[i]) * 16777619u;
+      }
+      return hs;
+
+    case LVAL_FUN:
+      if (v->builtin) { return (size_t)v->builtin; }
+      return lval_hash(v->formals) * 31 + lval_hash(v->body);
+
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:;
+      size_t h = v->count;
+      for (int i = 0; i < v->count; i++) {
+        h = h * 31 + lval_hash(v->cell[i]);
+      }
+      return h;
+
+    case LVAL_CONS:;
+      size_t hc = 0;
+      while (LTYPE(v) == LVAL_CONS) {
+        hc = hc * 31 + lval_hash(v->car);
+        v = v->cdr;
+      }
+      return hc * 31 + lval_hash(v);
+
+    case LVAL_VEC:;
+      size_t hv = v->len;
+      for (int i = 0; i < v->len; i++) {
+        hv = hv * 31 + lval_hash(lval_vec_get(v, i));
+      }
+      return hv;
+
+    case LVAL_ARR:;
+      size_t ha = v->alen * 2 + v->adbl;
+      for (int i = 0; i < v->alen; i++) {
+        ha = ha * 31 + (v->adbl ? lval_dbl_hash(v->dbls[i])
+          : (size_t)v->ints[i] * 2654435761u);
+      }
+      return ha;
+  }
+  return 0;
 }
 
 lval* builtin_eq(lenv* e, lval* a) {
-  return builtin_cmp(e, a, "==");
+  LASSERT_NUM("==", a, 2);
+  int r = lval_eq(a->cell[0], a->cell[1]);
+  lval_del(a);
+  return lval_num(r);
 }
 
 lval* builtin_ne(lenv* e, lval* a) {
-  return builtin_cmp(e, a, "!=");
+  LASSERT_NUM("!=", a, 2);
+  int r = !lval_eq(a->cell[0], a->cell[1]);
+  lval_del(a);
+  return lval_num(r);
 }
 
-lval* builtin_if(lenv* e, lval* a) {
+/* Checks the arguments of 'if' and returns the branch to evaluate */
+lval* lval_if_branch(lval* a) {
   LASSERT_NUM("if", a, 3);
   LASSERT_TYPE("if", a, 0, LVAL_NUM);
   LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
   LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
-  /* Mark both expressions as evaluate-able */
-  lval* x;
-  a->cell[1]->type = LVAL_SEXPR;
-  a->cell[2]->type = LVAL_SEXPR;
-
-  if (a->cell[0]->num) {
-    /* If condition is true evaluate first expression */
-    x = lval_eval(e, lval_pop(a, 1));
-  } else {
-    /* Otherwise evaluate second expression */
-    x = lval_eval(e, lval_pop(a, 2));
-  }
+  /* If condition is true take first expression, otherwise the second */
+  lval* x = lval_unshare(lval_pop(a, LNUM(a->cell[0]) ? 1 : 2));
 
-  /* Delete argument list and return */
+  /* Mark it as evaluate-able, delete argument list and return */
+  x->type = LVAL_SEXPR;
   lval_del(a);
   return x;
 }
 
+lval* builtin_if(lenv* e, lval* a) {
+  return lval_eval(e, lval_if_branch(a));
+}
+
 lval* builtin_load(lenv* e, lval* a) {
   LASSERT_NUM("load", a, 1);
   LASSERT_TYPE("load", a, 0, LVAL_STR);
@@ -962,21 +2845,32 @@ lval* builtin_load(lenv* e, lval* a) {
   /* Parse file given by string name */
   mpc_result_t r;
 
-  if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
+  if (mpc_parse_contents(lval_cstr(a->cell[0]), Lispy, &r)) {
 
     /* Read contents */
     lval* expr = lval_read(r.output);
     mpc_ast_delete(r.output);
 
+    /* Keep the arguments and remaining expressions alive in collections */
+    gc_push_root(a);
+    gc_push_root(expr);
+
     /* evaluate each expression */
     while (expr->count) {
+      larena m = arena_open();
       lval* x = lval_eval(e, lval_pop(expr, 0));
 
       /* If evaluate leads to error print it */
-      if (x->type == LVAL_ERR) { lval_println(e, x); }
+      if (LTYPE(x) == LVAL_ERR) { lval_println(e, x); }
       lval_del(x);
+      arena_close(m);
+
+      gc_safepoint(e);
     }
 
+    gc_pop_root();
+    gc_pop_root();
+
     /* Delete expression and arguments */
     lval_del(expr);
     lval_del(a);
@@ -1018,117 +2912,2480 @@ lval* builtin_error(lenv* e, lval* a) {
   LASSERT_TYPE("error", a, 0, LVAL_STR);
 
   /* Construct error from first argument */
-  lval* err = lval_err(a->cell[0]->str);
+  lval* err = lval_err(lval_cstr(a->cell[0]));
 
   lval_del(a);
 
   return err;
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-  lval* k = lval_sym(name);
-  lval* v = lval_fun(func);
-  lenv_put(e, k, v);
-  lval_del(k);
-  lval_del(v);
+void pool_print(lpool* p, int cap) {
+  if (!p->nslabs) { return; }
+  printf("%-5s %5i  in use %8li  allocated %8li  freed %8li  slabs %li\n",
+      p->name, cap, p->allocs - p->frees, p->allocs, p->frees, p->nslabs);
 }
 
-void lenv_add_builtins(lenv* e) {
-  /* List functions */
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "join", builtin_join);
+/* Arguments are ignored, e.g. (stats {}) */
+lval* builtin_stats(lenv* e, lval* a) {
+  /* Print one line for each pool that has been used */
+  pool_print(&lval_pool, 1);
+  pool_print(&lenv_pool, 1);
+  for (int k = 0; k < POOL_CELL_CLASSES; k++) {
+    pool_print(&cell_pools[k], 1 << k);
+  }
 
-  /* Lambda */
-  lenv_add_builtin(e, "\\", builtin_lambda);
+  lval_del(a);
+  return lval_sexpr();
+}
 
-  /* Mathematical functions */
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
+/* Wraps function 'f' in a cache of at most 'size' results */
+lval* lval_memo(lval* f, long size) {
+  lmemo* m = malloc(sizeof(lmemo));
+  m->refs = 1;
+  m->fun = lval_promote(f);
+  m->nsets = lval_capacity((size + MEMO_WAYS - 1) / MEMO_WAYS);
+  m->clock = 0;
+  m->entries = calloc(m->nsets * MEMO_WAYS, sizeof(lmemo_entry));
+
+  lval* v = lval_new(LVAL_FUN);
+  v->builtin = builtin_memo;
+  v->memo = m;
+  return v;
+}
 
-  /* Arithmetic comparison functions */
-  lenv_add_builtin(e, ">", builtin_gt);
-  lenv_add_builtin(e, "<", builtin_lt);
-  lenv_add_builtin(e, ">=", builtin_ge);
-  lenv_add_builtin(e, "<=", builtin_le);
-  lenv_add_builtin(e, "&&", builtin_and);
-  lenv_add_builtin(e, "||", builtin_or);
-  lenv_add_builtin(e, "!", builtin_not);
+/* Calls memoized function 'f', only evaluating arguments it hasn't */
+/* seen. Errors are not cached. */
+lval* lval_memo_call(lenv* e, lval* f, lval* a) {
+  lmemo* m = f->memo;
+  size_t h = lval_hash(a);
+  lmemo_entry* set = &m->entries[(h & (m->nsets - 1)) * MEMO_WAYS];
+
+  for (int i = 0; i < MEMO_WAYS; i++) {
+    if (set[i].args && set[i].hash == h
+        && lval_equal(set[i].args, a, 1)) {
+      set[i].used = ++m->clock;
+      lval* x = lval_copy(set[i].val);
+      lval_del(a);
+      lval_del(f);
+      return x;
+    }
+  }
 
-  /* Equality*/
-  lenv_add_builtin(e, "==", builtin_eq);
-  lenv_add_builtin(e, "!=", builtin_ne);
+  /* The cache outlives the expression, like globals */
+  lval* args = lval_promote(lval_copy(a));
+  lval* x = lval_call(e, lval_copy(m->fun), a);
+  if (LTYPE(x) == LVAL_ERR) {
+    lval_del(args);
+    lval_del(f);
+    return x;
+  }
 
-  lenv_add_builtin(e, "if", builtin_if);
+  /* Use an empty entry, or else replace the least recently used */
+  lmemo_entry* slot = &set[0];
+  for (int i = 0; i < MEMO_WAYS; i++) {
+    if (!set[i].args) { slot = &set[i]; break; }
+    if (set[i].used < slot->used) { slot = &set[i]; }
+  }
+  if (slot->args) {
+    lval_del(slot->args);
+    lval_del(slot->val);
+  }
+  slot->hash = h;
+  slot->used = ++m->clock;
+  slot->args = args;
+  slot->val = lval_promote(lval_copy(x));
 
-  /* Variable functions */
-  lenv_add_builtin(e, "def", builtin_def);
-  lenv_add_builtin(e, "=", builtin_put);
+  lval_del(f);
+  return x;
+}
 
-  /* String functions */
-  lenv_add_builtin(e, "load", builtin_load);
-  lenv_add_builtin(e, "error", builtin_error);
-  lenv_add_builtin(e, "print", builtin_print);
+/* (memo f) or (memo f size), a version of f that remembers its results. */
+/* Only meant for functions without side effects. */
+lval* builtin_memo(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function 'memo' passed incorrect number of arguments. "
+    "Got %i, Expected 1 or 2.", a->count);
+  LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+
+  long size = MEMO_DEFAULT;
+  if (a->count == 2) {
+    LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+    size = LNUM(a->cell[1]);
+    LASSERT(a, size > 0 && size <= MEMO_MAX,
+      "Function 'memo' passed size %li, Expected 1 to %i.", size, MEMO_MAX);
+  }
+
+  return lval_memo(lval_take(a, 0), size);
 }
 
-lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
-  x->type = v->type;
+lval* lval_vec(void) {
+  lval* v = lval_new(LVAL_VEC);
+  v->len = 0;
+  v->shift = VEC_BITS;
+  v->root = NULL;
+  v->tail = NULL;
+  return v;
+}
 
-  switch (v->type) {
-    /* Copy functions numbers directly */
-    case LVAL_NUM: x->num = v->num; break;
+/* Points vector 'x' at the nodes of 'v' */
+void lval_vec_share(lval* x, lval* v) {
+  x->len = v->len;
+  x->shift = v->shift;
+  x->root = v->root;
+  x->tail = v->tail;
+  if (x->root) { x->root->refs++; }
+  if (x->tail) { x->tail->refs++; }
+}
 
-    case LVAL_FUN:;
-      if (v->builtin) {
-        x->builtin = v->builtin;
-      } else {
-        x->builtin = NULL;
-        x->env = lenv_copy(v->env);
-        x->formals = lval_copy(v->formals);
+/* Returns node 'n' at height 'shift' if only the caller refers to it, */
+/* otherwise a copy sharing its children */
+lvnode* vnode_unshare(lvnode* n, int shift) {
+  if (n->refs == 1) {
+    n->young = 1;
+    return n;
+  }
+
+  lvnode* x = vnode_new();
+  for (int i = 0; i < VEC_WIDTH; i++) {
+    if (shift == 0 && n->vals[i]) { x->vals[i] = lval_copy(n->vals[i]); }
+    if (shift > 0 && n->kids[i]) {
+      x->kids[i] = n->kids[i];
+      x->kids[i]->refs++;
+    }
+  }
+  n->refs--;
+  return x;
+}
+
+/* A chain of nodes from height 'shift' down to leaf 'n' */
+lvnode* vnode_path(int shift, lvnode* n) {
+  if (shift == 0) { return n; }
+  lvnode* x = vnode_new();
+  x->kids[0] = vnode_path(shift - VEC_BITS, n);
+  return x;
+}
+
+/* Adds the full leaf 'leaf' after the first 'len' values under 'n' */
+lvnode* vnode_push(lvnode* n, int shift, int len, lvnode* leaf) {
+  n = n ? vnode_unshare(n, shift) : vnode_new();
+  int i = ((len - 1) >> shift) & (VEC_WIDTH - 1);
+  if (shift == VEC_BITS) {
+    n->kids[i] = leaf;
+  } else if (n->kids[i]) {
+    n->kids[i] = vnode_push(n->kids[i], shift - VEC_BITS, len, leaf);
+  } else {
+    n->kids[i] = vnode_path(shift - VEC_BITS, leaf);
+  }
+  return n;
+}
+
+lvnode* vnode_set(lvnode* n, int shift, int i, lval* x) {
+  n = vnode_unshare(n, shift);
+  int k = (i >> shift) & (VEC_WIDTH - 1);
+  if (shift == 0) {
+    lval_del(n->vals[k]);
+    n->vals[k] = x;
+  } else {
+    n->kids[k] = vnode_set(n->kids[k], shift - VEC_BITS, i, x);
+  }
+  return n;
+}
+
+/* Appends 'x' to vector 'v'. Both are consumed, and 'v' is only */
+/* changed in place if nothing else refers to it. */
+lval* lval_vec_push(lval* v, lval* x) {
+  v = lval_unshare(v);
+  int tailoff = lval_vec_tailoff(v);
+
+  /* Room in the tail */
+  if (v->len - tailoff < VEC_WIDTH) {
+    v->tail = v->tail ? vnode_unshare(v->tail, 0) : vnode_new();
+    v->tail->vals[v->len - tailoff] = x;
+    v->len++;
+    return v;
+  }
+
+  /* Otherwise the full tail moves into the trie, adding a level when */
+  /* the root is full too */
+  lvnode* leaf = v->tail;
+  if ((v->len >> VEC_BITS) > (1 << v->shift)) {
+    lvnode* root = vnode_new();
+    root->kids[0] = v->root;
+    root->kids[1] = vnode_path(v->shift, leaf);
+    v->root = root;
+    v->shift += VEC_BITS;
+  } else {
+    v->root = vnode_push(v->root, v->shift, v->len, leaf);
+  }
+
+  v->tail = vnode_new();
+  v->tail->vals[0] = x;
+  v->len++;
+  return v;
+}
+
+/* Replaces the value at 'i' of vector 'v' with 'x', consuming both */
+lval* lval_vec_set(lval* v, int i, lval* x) {
+  v = lval_unshare(v);
+  if (i >= lval_vec_tailoff(v)) {
+    v->tail = vnode_set(v->tail, 0, i, x);
+  } else {
+    v->root = vnode_set(v->root, v->shift, i, x);
+  }
+  return v;
+}
+
+#define LASSERT_INDEX(func, args, v, i) \
+  LASSERT(args, i >= 0 && i < v->len, \
+    "Function '%s' passed index %li, Vector has length %i.", \
+    func, i, v->len)
+
+/* (vec {1 2 3}), a vector of the elements of a Q-Expression */
+lval* builtin_vec(lenv* e, lval* a) {
+  LASSERT_NUM("vec", a, 1);
+  LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
+
+  lval* q = a->cell[0];
+  lval* v = lval_vec();
+  for (int i = 0; i < q->count; i++) {
+    v = lval_vec_push(v, lval_copy(q->cell[i]));
+  }
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_vget(lenv* e, lval* a) {
+  LASSERT_NUM("vget", a, 2);
+  LASSERT_TYPE("vget", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vget", a, 1, LVAL_NUM);
+  long i = LNUM(a->cell[1]);
+  LASSERT_INDEX("vget", a, a->cell[0], i);
+
+  lval* x = lval_copy(lval_vec_get(a->cell[0], i));
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_vset(lenv* e, lval* a) {
+  LASSERT_NUM("vset", a, 3);
+  LASSERT_TYPE("vset", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vset", a, 1, LVAL_NUM);
+  long i = LNUM(a->cell[1]);
+  LASSERT_INDEX("vset", a, a->cell[0], i);
+
+  lval* x = lval_pop(a, 2);
+  lval* v = lval_pop(a, 0);
+  lval_del(a);
+  return lval_vec_set(v, i, x);
+}
+
+lval* builtin_vpush(lenv* e, lval* a) {
+  LASSERT_NUM("vpush", a, 2);
+  LASSERT_TYPE("vpush", a, 0, LVAL_VEC);
+
+  lval* x = lval_pop(a, 1);
+  return lval_vec_push(lval_take(a, 0), x);
+}
+
+lval* builtin_vlen(lenv* e, lval* a) {
+  LASSERT_NUM("vlen", a, 1);
+  LASSERT_TYPE("vlen", a, 0, LVAL_VEC);
+
+  int n = a->cell[0]->len;
+  lval_del(a);
+  return lval_num(n);
+}
+
+/* Arrays are packed runs of longs or doubles for bulk arithmetic. Each */
+/* kernel has an AVX2 version, chosen at run time on x86-64 processors */
+/* that support it, and a plain loop over four lanes that compilers turn */
+/* into SSE or NEON code. */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define ARR_AVX2 1
+#define ARR_TARGET __attribute__((target("avx2")))
+
+int arr_avx2 = -1;
+
+int arr_has_avx2(void) {
+  if (arr_avx2 < 0) {
+    __builtin_cpu_init();
+    arr_avx2 = __builtin_cpu_supports("avx2") != 0;
+  }
+  return arr_avx2;
+}
+#else
+#define arr_has_avx2() 0
+#endif
+
+/* Adds up four lane sums and the elements after 'i'. Lanes whose 'of' */
+/* has its sign bit set overflowed along the way. Returns 0 if the sum */
+/* doesn't fit in a long. */
+int arr_sum_finish(long* lanes, long* of, long* d, int i, int n, long* r) {
+  long x = 0;
+  for (int k = 0; k < 4; k++) {
+    if (of[k] < 0 || __builtin_add_overflow(x, lanes[k], &x)) { return 0; }
+  }
+  for (; i < n; i++) {
+    if (__builtin_add_overflow(x, d[i], &x)) { return 0; }
+  }
+  *r = x;
+  return 1;
+}
+
+/* Overflow of t = a + b shows in the sign bit of (a ^ t) & (b ^ t) */
+int arr_sum_int_plain(long* d, int n, long* r) {
+  long lanes[4] = {0, 0, 0, 0};
+  long of[4] = {0, 0, 0, 0};
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    for (int k = 0; k < 4; k++) {
+      long t = (long)((unsigned long)lanes[k] + (unsigned long)d[i+k]);
+      of[k] |= (lanes[k] ^ t) & (d[i+k] ^ t);
+      lanes[k] = t;
+    }
+  }
+  return arr_sum_finish(lanes, of, d, i, n, r);
+}
+
+double arr_sum_dbl_plain(double* d, int n) {
+  double lanes[4] = {0, 0, 0, 0};
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    for (int k = 0; k < 4; k++) { lanes[k] += d[i+k]; }
+  }
+  double x = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  for (; i < n; i++) { x += d[i]; }
+  return x;
+}
+
+double arr_prod_dbl_plain(double* d, int n) {
+  double lanes[4] = {1, 1, 1, 1};
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    for (int k = 0; k < 4; k++) { lanes[k] *= d[i+k]; }
+  }
+  double x = (lanes[0] * lanes[1]) * (lanes[2] * lanes[3]);
+  for (; i < n; i++) { x *= d[i]; }
+  return x;
+}
+
+double arr_dot_dbl_plain(double* a, double* b, int n) {
+  double lanes[4] = {0, 0, 0, 0};
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    for (int k = 0; k < 4; k++) { lanes[k] += a[i+k] * b[i+k]; }
+  }
+  double x = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  for (; i < n; i++) { x += a[i] * b[i]; }
+  return x;
+}
+
+/* Smallest and largest elements of a non-empty array */
+void arr_range_int_plain(long* d, int n, long* lo, long* hi) {
+  long l = d[0];
+  long h = d[0];
+  for (int i = 1; i < n; i++) {
+    l = d[i] < l ? d[i] : l;
+    h = d[i] > h ? d[i] : h;
+  }
+  *lo = l;
+  *hi = h;
+}
+
+void arr_range_dbl_plain(double* d, int n, double* lo, double* hi) {
+  double l = d[0];
+  double h = d[0];
+  for (int i = 1; i < n; i++) {
+    l = d[i] < l ? d[i] : l;
+    h = d[i] > h ? d[i] : h;
+  }
+  *lo = l;
+  *hi = h;
+}
+
+/* r = d + k, returning 0 if any element overflowed */
+int arr_add_int_plain(long* r, long* d, int n, long k) {
+  long of = 0;
+  for (int i = 0; i < n; i++) {
+    long t = (long)((unsigned long)d[i] + (unsigned long)k);
+    of |= (d[i] ^ t) & (k ^ t);
+    r[i] = t;
+  }
+  return of >= 0;
+}
+
+void arr_add_dbl_plain(double* r, double* d, int n, double k) {
+  for (int i = 0; i < n; i++) { r[i] = d[i] + k; }
+}
+
+/* Copies the elements greater than 't' to 'r', returning how many */
+int arr_filter_int_plain(long* r, long* d, int n, long t) {
+  int m = 0;
+  for (int i = 0; i < n; i++) {
+    r[m] = d[i];
+    m += d[i] > t;
+  }
+  return m;
+}
+
+int arr_filter_dbl_plain(double* r, double* d, int n, double t) {
+  int m = 0;
+  for (int i = 0; i < n; i++) {
+    r[m] = d[i];
+    m += d[i] > t;
+  }
+  return m;
+}
+
+#ifdef ARR_AVX2
+ARR_TARGET int arr_sum_int_avx2(long* d, int n, long* r) {
+  __m256i s = _mm256_setzero_si256();
+  __m256i of = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((__m256i*)(d + i));
+    __m256i t = _mm256_add_epi64(s, x);
+    of = _mm256_or_si256(of, _mm256_and_si256(
+      _mm256_xor_si256(s, t), _mm256_xor_si256(x, t)));
+    s = t;
+  }
+
+  long lanes[4];
+  long ofs[4];
+  _mm256_storeu_si256((__m256i*)lanes, s);
+  _mm256_storeu_si256((__m256i*)ofs, of);
+  return arr_sum_finish(lanes, ofs, d, i, n, r);
+}
+
+ARR_TARGET double arr_sum_dbl_avx2(double* d, int n) {
+  __m256d s0 = _mm256_setzero_pd();
+  __m256d s1 = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = _mm256_add_pd(s0, _mm256_loadu_pd(d + i));
+    s1 = _mm256_add_pd(s1, _mm256_loadu_pd(d + i + 4));
+  }
+
+  double lanes[4];
+  _mm256_storeu_pd(lanes, _mm256_add_pd(s0, s1));
+  double x = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  for (; i < n; i++) { x += d[i]; }
+  return x;
+}
+
+ARR_TARGET double arr_prod_dbl_avx2(double* d, int n) {
+  __m256d p = _mm256_set1_pd(1);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    p = _mm256_mul_pd(p, _mm256_loadu_pd(d + i));
+  }
+
+  double lanes[4];
+  _mm256_storeu_pd(lanes, p);
+  double x = (lanes[0] * lanes[1]) * (lanes[2] * lanes[3]);
+  for (; i < n; i++) { x *= d[i]; }
+  return x;
+}
+
+ARR_TARGET double arr_dot_dbl_avx2(double* a, double* b, int n) {
+  __m256d s = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+    s = _mm256_add_pd(s, x);
+  }
+
+  double lanes[4];
+  _mm256_storeu_pd(lanes, s);
+  double x = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  for (; i < n; i++) { x += a[i] * b[i]; }
+  return x;
+}
+
+ARR_TARGET void arr_range_int_avx2(long* d, int n, long* lo, long* hi) {
+  __m256i l = _mm256_set1_epi64x(d[0]);
+  __m256i h = l;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((__m256i*)(d + i));
+    l = _mm256_blendv_epi8(l, x, _mm256_cmpgt_epi64(l, x));
+    h = _mm256_blendv_epi8(h, x, _mm256_cmpgt_epi64(x, h));
+  }
+
+  long ls[4];
+  long hs[4];
+  _mm256_storeu_si256((__m256i*)ls, l);
+  _mm256_storeu_si256((__m256i*)hs, h);
+  for (int k = 1; k < 4; k++) {
+    ls[0] = ls[k] < ls[0] ? ls[k] : ls[0];
+    hs[0] = hs[k] > hs[0] ? hs[k] : hs[0];
+  }
+  for (; i < n; i++) {
+    ls[0] = d[i] < ls[0] ? d[i] : ls[0];
+    hs[0] = d[i] > hs[0] ? d[i] : hs[0];
+  }
+  *lo = ls[0];
+  *hi = hs[0];
+}
+
+ARR_TARGET void arr_range_dbl_avx2(double* d, int n, double* lo, double* hi) {
+  __m256d l = _mm256_set1_pd(d[0]);
+  __m256d h = l;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(d + i);
+    l = _mm256_min_pd(x, l);
+    h = _mm256_max_pd(x, h);
+  }
+
+  double ls[4];
+  double hs[4];
+  _mm256_storeu_pd(ls, l);
+  _mm256_storeu_pd(hs, h);
+  for (int k = 1; k < 4; k++) {
+    ls[0] = ls[k] < ls[0] ? ls[k] : ls[0];
+    hs[0] = hs[k] > hs[0] ? hs[k] : hs[0];
+  }
+  for (; i < n; i++) {
+    ls[0] = d[i] < ls[0] ? d[i] : ls[0];
+    hs[0] = d[i] > hs[0] ? d[i] : hs[0];
+  }
+  *lo = ls[0];
+  *hi = hs[0];
+}
+
+ARR_TARGET int arr_add_int_avx2(long* r, long* d, int n, long k) {
+  __m256i kv = _mm256_set1_epi64x(k);
+  __m256i of = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((__m256i*)(d + i));
+    __m256i t = _mm256_add_epi64(x, kv);
+    of = _mm256_or_si256(of, _mm256_and_si256(
+      _mm256_xor_si256(x, t), _mm256_xor_si256(kv, t)));
+    _mm256_storeu_si256((__m256i*)(r + i), t);
+  }
+
+  if (_mm256_movemask_pd(_mm256_castsi256_pd(of))) { return 0; }
+  return arr_add_int_plain(r + i, d + i, n - i, k);
+}
+
+ARR_TARGET void arr_add_dbl_avx2(double* r, double* d, int n, double k) {
+  __m256d kv = _mm256_set1_pd(k);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(r + i, _mm256_add_pd(_mm256_loadu_pd(d + i), kv));
+  }
+  arr_add_dbl_plain(r + i, d + i, n - i, k);
+}
+
+/* Compares four at a time, then copies out the lanes whose mask bit */
+/* is set */
+ARR_TARGET int arr_filter_int_avx2(long* r, long* d, int n, long t) {
+  __m256i tv = _mm256_set1_epi64x(t);
+  int m = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((__m256i*)(d + i));
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(x, tv)));
+    while (mask) {
+      r[m++] = d[i + __builtin_ctz(mask)];
+      mask &= mask - 1;
+    }
+  }
+  return m + arr_filter_int_plain(r + m, d + i, n - i, t);
+}
+
+ARR_TARGET int arr_filter_dbl_avx2(double* r, double* d, int n, double t) {
+  __m256d tv = _mm256_set1_pd(t);
+  int m = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(d + i);
+    int mask = _mm256_movemask_pd(_mm256_cmp_pd(x, tv, _CMP_GT_OQ));
+    while (mask) {
+      r[m++] = d[i + __builtin_ctz(mask)];
+      mask &= mask - 1;
+    }
+  }
+  return m + arr_filter_dbl_plain(r + m, d + i, n - i, t);
+}
+
+#define ARR_KERNEL(name, ...) \
+  (arr_has_avx2() ? name##_avx2(__VA_ARGS__) : name##_plain(__VA_ARGS__))
+#else
+#define ARR_KERNEL(name, ...) name##_plain(__VA_ARGS__)
+#endif
+
+/* A new array of 'n' uninitialized elements */
+lval* lval_arr(int n, int dbl) {
+  lval* v = lval_new(LVAL_ARR);
+  v->alen = n;
+  v->adbl = dbl;
+  v->ints = malloc(sizeof(long) * (n ? n : 1));
+  return v;
+}
+
+/* Element 'i' of an array as a Number or Double */
+lval* lval_arr_get(lval* v, int i) {
+  return v->adbl ? lval_dbl(v->dbls[i]) : lval_num(v->ints[i]);
+}
+
+/* Sums or multiplies a long array exactly, promoting to a bignum once */
+/* the result overflows */
+lval* lval_arr_fold(long* d, int n, long x, char op) {
+  lval* r = NULL;
+  for (int i = 0; i < n; i++) {
+    if (!r) {
+      long t;
+      if (op == '+' ? !__builtin_add_overflow(x, d[i], &t)
+                    : !__builtin_mul_overflow(x, d[i], &t)) {
+        x = t;
+        continue;
+      }
+      r = lval_num(x);
+    }
+    lval* y = lval_num(d[i]);
+    lval* z = lval_num_op(r, y, op);
+    lval_del(y);
+    lval_del(r);
+    r = z;
+  }
+  return r ? r : lval_num(x);
+}
+
+#define LASSERT_ARR_NOT_EMPTY(func, args, index) \
+  LASSERT(args, args->cell[index]->alen != 0, \
+    "Function '%s' passed an empty Array for argument %i.", func, index);
+
+/* (array {1 2 3}), an array of longs, or of doubles if any element is */
+/* a Double */
+lval* builtin_array(lenv* e, lval* a) {
+  LASSERT_NUM("array", a, 1);
+  LASSERT_TYPE("array", a, 0, LVAL_QEXPR);
+
+  lval* q = a->cell[0];
+  int dbl = 0;
+  for (int i = 0; i < q->count; i++) {
+    lval* x = q->cell[i];
+    LASSERT(a, LVAL_IS_LONG(x) || LTYPE(x) == LVAL_DBL,
+      "Function 'array' passed a %s in its list, Expected %s or %s.",
+      LBIG(x) ? "Number too big for an Array" : ltype_name(LTYPE(x)),
+      ltype_name(LVAL_NUM), ltype_name(LVAL_DBL));
+    dbl |= LTYPE(x) == LVAL_DBL;
+  }
+
+  lval* v = lval_arr(q->count, dbl);
+  for (int i = 0; i < q->count; i++) {
+    if (dbl) {
+      v->dbls[i] = lval_to_dbl(q->cell[i]);
+    } else {
+      v->ints[i] = LNUM(q->cell[i]);
+    }
+  }
+  lval_del(a);
+  return v;
+}
+
+/* (arange n), the array of longs 0 to n - 1 */
+lval* builtin_arange(lenv* e, lval* a) {
+  LASSERT_NUM("arange", a, 1);
+  LASSERT_TYPE("arange", a, 0, LVAL_NUM);
+  long n = LNUM(a->cell[0]);
+  LASSERT(a, n >= 0 && n <= INT_MAX,
+    "Function 'arange' passed length %li, Expected 0 to %i.", n, INT_MAX);
+
+  lval* v = lval_arr(n, 0);
+  for (int i = 0; i < n; i++) { v->ints[i] = i; }
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_aget(lenv* e, lval* a) {
+  LASSERT_NUM("aget", a, 2);
+  LASSERT_TYPE("aget", a, 0, LVAL_ARR);
+  LASSERT_TYPE("aget", a, 1, LVAL_NUM);
+  long i = LNUM(a->cell[1]);
+  LASSERT(a, i >= 0 && i < a->cell[0]->alen,
+    "Function 'aget' passed index %li, Array has length %i.",
+    i, a->cell[0]->alen);
+
+  lval* x = lval_arr_get(a->cell[0], i);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_alen(lenv* e, lval* a) {
+  LASSERT_NUM("alen", a, 1);
+  LASSERT_TYPE("alen", a, 0, LVAL_ARR);
+
+  int n = a->cell[0]->alen;
+  lval_del(a);
+  return lval_num(n);
+}
+
+lval* builtin_asum(lenv* e, lval* a) {
+  LASSERT_NUM("asum", a, 1);
+  LASSERT_TYPE("asum", a, 0, LVAL_ARR);
+
+  lval* v = a->cell[0];
+  lval* r;
+  long x;
+  if (v->adbl) {
+    r = lval_dbl(ARR_KERNEL(arr_sum_dbl, v->dbls, v->alen));
+  } else if (ARR_KERNEL(arr_sum_int, v->ints, v->alen, &x)) {
+    r = lval_num(x);
+  } else {
+    r = lval_arr_fold(v->ints, v->alen, 0, '+');
+  }
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_aprod(lenv* e, lval* a) {
+  LASSERT_NUM("aprod", a, 1);
+  LASSERT_TYPE("aprod", a, 0, LVAL_ARR);
+
+  lval* v = a->cell[0];
+  lval* r = v->adbl
+    ? lval_dbl(ARR_KERNEL(arr_prod_dbl, v->dbls, v->alen))
+    : lval_arr_fold(v->ints, v->alen, 1, '*');
+  lval_del(a);
+  return r;
+}
+
+/* (adot a b), the sum of the products of matching elements */
+lval* builtin_adot(lenv* e, lval* a) {
+  LASSERT_NUM("adot", a, 2);
+  LASSERT_TYPE("adot", a, 0, LVAL_ARR);
+  LASSERT_TYPE("adot", a, 1, LVAL_ARR);
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+  LASSERT(a, x->alen == y->alen,
+    "Function 'adot' passed Arrays of length %i and %i.", x->alen, y->alen);
+
+  lval* r;
+  if (x->adbl && y->adbl) {
+    r = lval_dbl(ARR_KERNEL(arr_dot_dbl, x->dbls, y->dbls, x->alen));
+  } else if (x->adbl || y->adbl) {
+    double s = 0;
+    for (int i = 0; i < x->alen; i++) {
+      s += (x->adbl ? x->dbls[i] : x->ints[i])
+        * (y->adbl ? y->dbls[i] : y->ints[i]);
+    }
+    r = lval_dbl(s);
+  } else {
+    /* Exact, moving to bignums if a product or the sum overflows */
+    r = lval_num(0);
+    for (int i = 0; i < x->alen; i++) {
+      long p;
+      lval* t;
+      if (__builtin_mul_overflow(x->ints[i], y->ints[i], &p)) {
+        lval* xi = lval_num(x->ints[i]);
+        lval* yi = lval_num(y->ints[i]);
+        t = lval_num_op(xi, yi, '*');
+        lval_del(xi);
+        lval_del(yi);
+      } else {
+        t = lval_num(p);
+      }
+      lval* z = lval_num_op(r, t, '+');
+      lval_del(t);
+      lval_del(r);
+      r = z;
+    }
+  }
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_aextreme(lenv* e, lval* a, char* func, int hi) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_ARR);
+  LASSERT_ARR_NOT_EMPTY(func, a, 0);
+
+  lval* v = a->cell[0];
+  lval* r;
+  if (v->adbl) {
+    double l, h;
+    ARR_KERNEL(arr_range_dbl, v->dbls, v->alen, &l, &h);
+    r = lval_dbl(hi ? h : l);
+  } else {
+    long l, h;
+    ARR_KERNEL(arr_range_int, v->ints, v->alen, &l, &h);
+    r = lval_num(hi ? h : l);
+  }
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_amin(lenv* e, lval* a) {
+  return builtin_aextreme(e, a, "amin", 0);
+}
+
+lval* builtin_amax(lenv* e, lval* a) {
+  return builtin_aextreme(e, a, "amax", 1);
+}
+
+/* (amap-add a k), k added to each element. Adding a Double to an array */
+/* of longs gives an array of doubles. */
+lval* builtin_amap_add(lenv* e, lval* a) {
+  LASSERT_NUM("amap-add", a, 2);
+  LASSERT_TYPE("amap-add", a, 0, LVAL_ARR);
+  LASSERT_NUMERIC("amap-add", a, 1);
+
+  lval* v = a->cell[0];
+  lval* k = a->cell[1];
+  lval* r;
+  if (v->adbl || LTYPE(k) == LVAL_DBL) {
+    r = lval_arr(v->alen, 1);
+    double* d = v->dbls;
+    if (!v->adbl) {
+      for (int i = 0; i < v->alen; i++) { r->dbls[i] = v->ints[i]; }
+      d = r->dbls;
+    }
+    ARR_KERNEL(arr_add_dbl, r->dbls, d, v->alen, lval_to_dbl(k));
+  } else {
+    r = lval_arr(v->alen, 0);
+    if (LBIG(k) || !ARR_KERNEL(arr_add_int, r->ints, v->ints, v->alen, LNUM(k))) {
+      lval_del(r);
+      lval_del(a);
+      return lval_err("Function 'amap-add' overflowed an Array element.");
+    }
+  }
+  lval_del(a);
+  return r;
+}
+
+/* (afilter-gt a t), the elements of a greater than t, in order */
+lval* builtin_afilter_gt(lenv* e, lval* a) {
+  LASSERT_NUM("afilter-gt", a, 2);
+  LASSERT_TYPE("afilter-gt", a, 0, LVAL_ARR);
+  LASSERT_NUMERIC("afilter-gt", a, 1);
+
+  lval* v = a->cell[0];
+  lval* t = a->cell[1];
+  lval* r = lval_arr(v->alen, v->adbl);
+  if (v->adbl) {
+    r->alen = ARR_KERNEL(arr_filter_dbl, r->dbls, v->dbls, v->alen,
+      lval_to_dbl(t));
+  } else if (LVAL_IS_LONG(t)) {
+    r->alen = ARR_KERNEL(arr_filter_int, r->ints, v->ints, v->alen, LNUM(t));
+  } else {
+    /* Longs are greater than x exactly when they are greater than its */
+    /* floor. Past either end of long it keeps all or none of them. */
+    double x = LTYPE(t) == LVAL_DBL ? floor(t->dbl) : lval_to_dbl(t);
+    if (x < (double)LONG_MIN) {
+      memcpy(r->ints, v->ints, sizeof(long) * v->alen);
+    } else if (x >= (double)LONG_MAX || isnan(x)) {
+      r->alen = 0;
+    } else {
+      r->alen = ARR_KERNEL(arr_filter_int, r->ints, v->ints, v->alen, (long)x);
+    }
+  }
+  lval_del(a);
+  return r;
+}
+
+lval* lval_cons(lval* car, lval* cdr) {
+  lval* v = lval_new(LVAL_CONS);
+  v->car = car;
+  v->cdr = cdr;
+  return v;
+}
+
+/* (cons x l), a cell holding x in front of l. l is shared rather than */
+/* copied and is normally another cell or {} */
+lval* builtin_cons(lenv* e, lval* a) {
+  LASSERT_NUM("cons", a, 2);
+
+  lval* cdr = lval_pop(a, 1);
+  return lval_cons(lval_take(a, 0), cdr);
+}
+
+lval* builtin_car(lenv* e, lval* a) {
+  LASSERT_NUM("car", a, 1);
+  LASSERT_TYPE("car", a, 0, LVAL_CONS);
+
+  lval* x = lval_copy(a->cell[0]->car);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_cdr(lenv* e, lval* a) {
+  LASSERT_NUM("cdr", a, 1);
+  LASSERT_TYPE("cdr", a, 0, LVAL_CONS);
+
+  lval* x = lval_copy(a->cell[0]->cdr);
+  lval_del(a);
+  return x;
+}
+
+/* Evaluates a Q-Expression like eval, printing how long it took */
+lval* builtin_time(lenv* e, lval* a) {
+  LASSERT_NUM("time", a, 1);
+  LASSERT_TYPE("time", a, 0, LVAL_QEXPR);
+
+  /* Wall clock time, so work done by pmap's workers is counted too */
+  struct timespec start, end;
+  timespec_get(&start, TIME_UTC);
+  lval* x = builtin_eval(e, a);
+  timespec_get(&end, TIME_UTC);
+  printf("Time: %.3fs\n", (double)(end.tv_sec - start.tv_sec)
+    + (double)(end.tv_nsec - start.tv_nsec) / 1e9);
+
+  return x;
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_fun(func);
+  lenv_def(e, k, v);
+  lval_del(k);
+  lval_del(v);
+}
+
+/* Writes a value to a file, for pmap's workers to send results back. */
+/* Builtins are sent as pointers, which stay valid across fork. */
+void lval_pack_bytes(FILE* f, char* s, size_t n) {
+  fwrite(&n, sizeof(n), 1, f);
+  fwrite(s, 1, n, f);
+}
+
+void lval_pack(FILE* f, lval* v) {
+  /* Cons lists are written a cell at a time, car first */
+  while (LTYPE(v) == LVAL_CONS) {
+    putc(LVAL_CONS, f);
+    lval_pack(f, v->car);
+    v = v->cdr;
+  }
+
+  int t = LTYPE(v);
+  putc(t, f);
+  switch (t) {
+    case LVAL_NUM:;
+      long n = LNUM(v);
+      lbig* b = LBIG(v);
+      int size = b ? b->size : 0;
+      fwrite(&n, sizeof(n), 1, f);
+      fwrite(&size, sizeof(size), 1, f);
+      if (b) {
+        fwrite(&b->sign, sizeof(b->sign), 1, f);
+        fwrite(b->d, sizeof(uint32_t), size, f);
+      }
+      break;
+
+    case LVAL_DBL: fwrite(&v->dbl, sizeof(v->dbl), 1, f); break;
+    case LVAL_ERR: lval_pack_bytes(f, v->err, strlen(v->err)); break;
+    case LVAL_SYM: lval_pack_bytes(f, v->sym, strlen(v->sym)); break;
+    case LVAL_STR: lval_pack_bytes(f, lval_str_chars(v), v->slen); break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      fwrite(&v->count, sizeof(v->count), 1, f);
+      for (int i = 0; i < v->count; i++) { lval_pack(f, v->cell[i]); }
+      break;
+
+    case LVAL_VEC:
+      fwrite(&v->len, sizeof(v->len), 1, f);
+      for (int i = 0; i < v->len; i++) { lval_pack(f, lval_vec_get(v, i)); }
+      break;
+
+    case LVAL_ARR:
+      fwrite(&v->alen, sizeof(v->alen), 1, f);
+      fwrite(&v->adbl, sizeof(v->adbl), 1, f);
+      fwrite(v->ints, sizeof(long), v->alen, f);
+      break;
+
+    /* Memoized functions are sent without their cache, and lambdas with */
+    /* any arguments already bound */
+    case LVAL_FUN:;
+      int kind = v->memo ? 2 : v->builtin ? 1 : 0;
+      putc(kind, f);
+      if (kind == 2) {
+        long entries = (long)v->memo->nsets * MEMO_WAYS;
+        fwrite(&entries, sizeof(entries), 1, f);
+        lval_pack(f, v->memo->fun);
+      } else if (kind == 1) {
+        fwrite(&v->builtin, sizeof(v->builtin), 1, f);
+      } else {
+        lval_pack(f, v->formals);
+        lval_pack(f, v->body);
+        fwrite(&v->env->count, sizeof(v->env->count), 1, f);
+        for (int i = 0; i < v->env->count; i++) {
+          lval_pack_bytes(f, v->env->syms[i], strlen(v->env->syms[i]));
+          lval_pack(f, v->env->vals[i]);
+        }
+      }
+      break;
+  }
+}
+
+char* lval_unpack_bytes(FILE* f, size_t* n) {
+  fread(n, sizeof(*n), 1, f);
+  char* s = malloc(*n + 1);
+  fread(s, 1, *n, f);
+  s[*n] = '\0';
+  return s;
+}
+
+/* Reads back a value written by lval_pack */
+lval* lval_unpack(FILE* f) {
+  lval* first = NULL;
+  lval** link = &first;
+  int t = getc(f);
+  while (t == LVAL_CONS) {
+    lval* car = lval_unpack(f);
+    *link = lval_cons(car, NULL);
+    link = &(*link)->cdr;
+    t = getc(f);
+  }
+
+  lval* v;
+  size_t n;
+  char* s;
+  switch (t) {
+    case LVAL_NUM:;
+      long num;
+      int size;
+      fread(&num, sizeof(num), 1, f);
+      fread(&size, sizeof(size), 1, f);
+      if (!size) {
+        v = lval_num(num);
+      } else {
+        int sign;
+        uint32_t* d = malloc(sizeof(uint32_t) * size);
+        fread(&sign, sizeof(sign), 1, f);
+        fread(d, sizeof(uint32_t), size, f);
+        v = lval_big(sign, d, size);
+        free(d);
+      }
+      break;
+
+    case LVAL_DBL:;
+      double x;
+      fread(&x, sizeof(x), 1, f);
+      v = lval_dbl(x);
+      break;
+
+    case LVAL_ERR:
+      s = lval_unpack_bytes(f, &n);
+      v = lval_err("%s", s);
+      free(s);
+      break;
+
+    case LVAL_SYM:
+      s = lval_unpack_bytes(f, &n);
+      v = lval_sym(s);
+      free(s);
+      break;
+
+    case LVAL_STR:
+      v = lval_new(LVAL_STR);
+      v->str = lval_unpack_bytes(f, &v->slen);
+      v->buf = NULL;
+      break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:;
+      int count;
+      fread(&count, sizeof(count), 1, f);
+      v = t == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+      for (int i = 0; i < count; i++) { v = lval_add(v, lval_unpack(f)); }
+      break;
+
+    case LVAL_VEC:;
+      int len;
+      fread(&len, sizeof(len), 1, f);
+      v = lval_vec();
+      for (int i = 0; i < len; i++) { v = lval_vec_push(v, lval_unpack(f)); }
+      break;
+
+    case LVAL_ARR:;
+      int alen, adbl;
+      fread(&alen, sizeof(alen), 1, f);
+      fread(&adbl, sizeof(adbl), 1, f);
+      v = lval_arr(alen, adbl);
+      fread(v->ints, sizeof(long), alen, f);
+      break;
+
+    case LVAL_FUN:;
+      int kind = getc(f);
+      if (kind == 2) {
+        long entries;
+        fread(&entries, sizeof(entries), 1, f);
+        v = lval_memo(lval_unpack(f), entries);
+      } else if (kind == 1) {
+        lbuiltin builtin;
+        fread(&builtin, sizeof(builtin), 1, f);
+        v = lval_fun(builtin);
+      } else {
+        lval* formals = lval_unpack(f);
+        lval* body = lval_unpack(f);
+        v = lval_lambda(formals, body);
+        int bound;
+        fread(&bound, sizeof(bound), 1, f);
+        for (int i = 0; i < bound; i++) {
+          s = lval_unpack_bytes(f, &n);
+          lval* k = lval_sym(s);
+          lval* x = lval_unpack(f);
+          lenv_put(v->env, k, x);
+          lval_del(k);
+          lval_del(x);
+          free(s);
+        }
+      }
+      break;
+
+    default:
+      v = lval_err("pmap got a result it couldn't read.");
+      break;
+  }
+
+  *link = v;
+  return first;
+}
+
+#ifdef _WIN32
+/* Without fork, pmap is map */
+lval* builtin_pmap(lenv* e, lval* a) {
+  if (a->count == 3) { lval_del(lval_pop(a, 2)); }
+  return builtin_map(e, a);
+}
+#else
+/* pmap splits its list into PMAP_CHUNKS chunks per worker, which the */
+/* workers take in turn so that slow elements don't hold up the rest. */
+/* Shorter lists are mapped in this process. */
+#define PMAP_CHUNKS 8
+#define PMAP_MIN 32
+#define PMAP_MAX_WORKERS 64
+
+/* Set in workers, which map any nested pmap themselves */
+int pmap_worker = 0;
+
+/* Evaluates the chunks whose numbers it reads from 'queue', writing */
+/* each number followed by its results to 'out' */
+void pmap_work(lenv* e, lval* f, lval* l, int chunks, int queue, FILE* out) {
+  pmap_worker = 1;
+
+  int c;
+  while (read(queue, &c, sizeof(c)) == sizeof(c)) {
+    fwrite(&c, sizeof(c), 1, out);
+    int end = (int)((long)(c + 1) * l->count / chunks);
+    for (int i = (int)((long)c * l->count / chunks); i < end; i++) {
+      lval* x = lval_list_apply(e, f, lval_list_item(e, l, i), NULL);
+      lval_pack(out, x);
+      lval_del(x);
+    }
+  }
+
+  fflush(out);
+  fflush(stdout);
+  _exit(ferror(out) ? 1 : 0);
+}
+
+/* (pmap f l) or (pmap f l n), map run by n worker processes, one per */
+/* processor by default. Each worker is forked with its own copy of */
+/* the interpreter, so evaluation in one can't affect another, and */
+/* results are joined back in order. Definitions made by f are lost */
+/* with the worker. */
+lval* builtin_pmap(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+    "Function 'pmap' passed incorrect number of arguments. "
+    "Got %i, Expected 2 or 3.", a->count);
+  LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+  LASSERT_TYPE("pmap", a, 1, LVAL_QEXPR);
+
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (a->count == 3) {
+    LASSERT_TYPE("pmap", a, 2, LVAL_NUM);
+    workers = LNUM(a->cell[2]);
+    LASSERT(a, workers >= 1 && workers <= PMAP_MAX_WORKERS,
+      "Function 'pmap' passed %li workers, Expected 1 to %i.",
+      workers, PMAP_MAX_WORKERS);
+    lval_del(lval_pop(a, 2));
+  }
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  if (workers > PMAP_MAX_WORKERS) { workers = PMAP_MAX_WORKERS; }
+  if (workers < 2 || l->count < PMAP_MIN || pmap_worker) {
+    return builtin_map(e, a);
+  }
+
+  /* Queue up the chunk numbers. They fit in the pipe's buffer. */
+  int chunks = workers * PMAP_CHUNKS;
+  if (chunks > l->count) { chunks = l->count; }
+  int queue[2];
+  if (pipe(queue) != 0) { return builtin_map(e, a); }
+  for (int c = 0; c < chunks; c++) {
+    if (write(queue[1], &c, sizeof(c)) != sizeof(c)) { break; }
+  }
+  close(queue[1]);
+
+  /* Output buffered now would be written again by every worker */
+  fflush(NULL);
+
+  FILE* out[PMAP_MAX_WORKERS];
+  pid_t pids[PMAP_MAX_WORKERS];
+  int started = 0;
+  for (int w = 0; w < workers; w++) {
+    out[started] = tmpfile();
+    if (!out[started]) { break; }
+    pids[started] = fork();
+    if (pids[started] < 0) {
+      fclose(out[started]);
+      break;
+    }
+    if (pids[started] == 0) { pmap_work(e, f, l, chunks, queue[0], out[started]); }
+    started++;
+  }
+  close(queue[0]);
+
+  /* With no workers running, map here like the other fallbacks */
+  if (started == 0) { return builtin_map(e, a); }
+
+  int failed = 0;
+  for (int w = 0; w < started; w++) {
+    int status;
+    if (waitpid(pids[w], &status, 0) != pids[w]
+        || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed = 1;
+    }
+  }
+
+  /* Read each worker's chunks back into place */
+  lval** vals = calloc(l->count, sizeof(lval*));
+  for (int w = 0; w < started; w++) {
+    rewind(out[w]);
+    int c;
+    while (!failed && fread(&c, sizeof(c), 1, out[w]) == 1) {
+      int end = (int)((long)(c + 1) * l->count / chunks);
+      for (int i = (int)((long)c * l->count / chunks); i < end; i++) {
+        vals[i] = lval_unpack(out[w]);
+      }
+    }
+    fclose(out[w]);
+  }
+
+  /* The first error in the list is returned, as map does */
+  lval* r = lval_qexpr();
+  for (int i = 0; i < l->count; i++) {
+    if (!vals[i]) { failed = 1; }
+    if (failed || LTYPE(r) == LVAL_ERR) {
+      if (vals[i]) { lval_del(vals[i]); }
+    } else if (LTYPE(vals[i]) == LVAL_ERR) {
+      lval_del(r);
+      r = vals[i];
+    } else {
+      r = lval_add(r, vals[i]);
+    }
+  }
+  free(vals);
+  lval_del(a);
+
+  if (failed) {
+    lval_del(r);
+    return lval_err("Function 'pmap' lost a worker before it finished.");
+  }
+  return r;
+}
+#endif
+
+void lenv_add_builtins(lenv* e) {
+  /* List functions */
+  lenv_add_builtin(e, "list", builtin_list);
+  lenv_add_builtin(e, "head", builtin_head);
+  lenv_add_builtin(e, "tail", builtin_tail);
+  lenv_add_builtin(e, "eval", builtin_eval);
+  lenv_add_builtin(e, "join", builtin_join);
+  lenv_add_builtin(e, "map", builtin_map);
+  lenv_add_builtin(e, "filter", builtin_filter);
+  lenv_add_builtin(e, "foldl", builtin_foldl);
+  lenv_add_builtin(e, "length", builtin_length);
+  lenv_add_builtin(e, "reverse", builtin_reverse);
+  lenv_add_builtin(e, "nth", builtin_nth);
+  lenv_add_builtin(e, "last", builtin_last);
+  lenv_add_builtin(e, "take", builtin_take);
+  lenv_add_builtin(e, "drop", builtin_drop);
+  lenv_add_builtin(e, "pmap", builtin_pmap);
+  lenv_add_builtin(e, "native", builtin_native);
+
+  /* Lambda */
+  lenv_add_builtin(e, "\\", builtin_lambda);
+
+  /* Mathematical functions */
+  lenv_add_builtin(e, "+", builtin_add);
+  lenv_add_builtin(e, "-", builtin_sub);
+  lenv_add_builtin(e, "*", builtin_mul);
+  lenv_add_builtin(e, "/", builtin_div);
+
+  /* Arithmetic comparison functions */
+  lenv_add_builtin(e, ">", builtin_gt);
+  lenv_add_builtin(e, "<", builtin_lt);
+  lenv_add_builtin(e, ">=", builtin_ge);
+  lenv_add_builtin(e, "<=", builtin_le);
+  lenv_add_builtin(e, "&&", builtin_and);
+  lenv_add_builtin(e, "||", builtin_or);
+  lenv_add_builtin(e, "!", builtin_not);
+
+  /* Equality*/
+  lenv_add_builtin(e, "==", builtin_eq);
+  lenv_add_builtin(e, "!=", builtin_ne);
+
+  lenv_add_builtin(e, "if", builtin_if);
+
+  /* Caching the results of pure functions */
+  lenv_add_builtin(e, "memo", builtin_memo);
+
+  /* Cons cell functions */
+  lenv_add_builtin(e, "cons", builtin_cons);
+  lenv_add_builtin(e, "car", builtin_car);
+  lenv_add_builtin(e, "cdr", builtin_cdr);
+
+  /* Vector functions */
+  lenv_add_builtin(e, "vec", builtin_vec);
+  lenv_add_builtin(e, "vget", builtin_vget);
+  lenv_add_builtin(e, "vset", builtin_vset);
+  lenv_add_builtin(e, "vpush", builtin_vpush);
+  lenv_add_builtin(e, "vlen", builtin_vlen);
+
+  /* Array functions */
+  lenv_add_builtin(e, "array", builtin_array);
+  lenv_add_builtin(e, "arange", builtin_arange);
+  lenv_add_builtin(e, "aget", builtin_aget);
+  lenv_add_builtin(e, "alen", builtin_alen);
+  lenv_add_builtin(e, "asum", builtin_asum);
+  lenv_add_builtin(e, "aprod", builtin_aprod);
+  lenv_add_builtin(e, "adot", builtin_adot);
+  lenv_add_builtin(e, "amin", builtin_amin);
+  lenv_add_builtin(e, "amax", builtin_amax);
+  lenv_add_builtin(e, "amap-add", builtin_amap_add);
+  lenv_add_builtin(e, "afilter-gt", builtin_afilter_gt);
+
+  /* Variable functions */
+  lenv_add_builtin(e, "def", builtin_def);
+  lenv_add_builtin(e, "=", builtin_put);
+
+  /* String functions */
+  lenv_add_builtin(e, "load", builtin_load);
+  lenv_add_builtin(e, "error", builtin_error);
+  lenv_add_builtin(e, "print", builtin_print);
+
+  /* Allocator statistics and timing */
+  lenv_add_builtin(e, "stats", builtin_stats);
+  lenv_add_builtin(e, "time", builtin_time);
+}
+
+/* Copies are shared, anything about to be modified goes through lval_unshare */
+lval* lval_copy(lval* v) {
+  if (LVAL_IS_FIXNUM(v)) { return v; }
+  v->refs++;
+  return v;
+}
+
+/* Returns a version of 'v' that only the caller refers to, copying the */
+/* top level if it is shared. Elements of lists remain shared. */
+lval* lval_unshare(lval* v) {
+  if (LVAL_IS_FIXNUM(v)) { return v; }
+
+  /* Slices always share their cells */
+  int slice = (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->base;
+  if (v->refs == 1 && !slice) { return v; }
+
+  lval* x = lval_new(v->type);
+
+  switch (v->type) {
+    /* Copy functions numbers directly */
+    case LVAL_NUM:
+      x->num = v->num;
+      x->big = lbig_copy(v->big);
+      break;
+
+    case LVAL_DBL: x->dbl = v->dbl; break;
+
+    case LVAL_ARR:
+      x->alen = v->alen;
+      x->adbl = v->adbl;
+      x->ints = malloc(sizeof(long) * v->alen);
+      memcpy(x->ints, v->ints, sizeof(long) * v->alen);
+      break;
+
+    case LVAL_FUN:;
+      /* The cache of a memoized function is shared between copies */
+      x->memo = v->memo;
+      if (x->memo) { x->memo->refs++; }
+
+      if (v->builtin) {
+        x->builtin = v->builtin;
+      } else {
+        /* Calls bind into the environment and pop the formals */
+        x->builtin = NULL;
+        x->env = lenv_copy(v->env);
+        x->formals = lval_unshare(lval_copy(v->formals));
         x->body = lval_copy(v->body);
+
+        /* Compiled code is immutable so it can be shared */
+        x->code = v->code;
+        if (x->code) { x->code->refs++; }
+      }
+      break;
+
+    /* Copy strings using malloc and strcpy */
+    case LVAL_ERR:
+      x->err = malloc(strlen(v->err) + 1);
+      strcpy(x->err, v->err);
+      break;
+
+    case LVAL_SYM:
+      x->sym = v->sym;
+      break;
+
+    case LVAL_STR:
+      lval_str_share(x, v);
+      break;
+
+    /* Copy lists by sharing each sub-expression */
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      x->count = v->count;
+      x->cell = NULL;
+      x->base = NULL;
+      lval_resize(x, 0, x->count);
+
+      for (int i = 0; i < x->count; i++) {
+        x->cell[i] = lval_copy(v->cell[i]);
+      }
+    break;
+
+    case LVAL_CONS:
+      x->car = lval_copy(v->car);
+      x->cdr = lval_copy(v->cdr);
+    break;
+
+    /* Vectors share their nodes, which are copied when written to */
+    case LVAL_VEC:
+      lval_vec_share(x, v);
+    break;
+  }
+
+  lval_del(v);
+  return x;
+}
+
+/* Promotes the values in the leaves under 'n' in place */
+void vnode_promote(lvnode* n, int shift) {
+  if (!n || !n->young) { return; }
+
+  for (int i = 0; i < VEC_WIDTH; i++) {
+    if (shift == 0 && n->vals[i]) { n->vals[i] = lval_promote(n->vals[i]); }
+    if (shift > 0) { vnode_promote(n->kids[i], shift - VEC_BITS); }
+  }
+  n->young = 0;
+}
+
+/* Returns a copy of 'v' outside the nursery and arena, along with any */
+/* young values it refers to. Used for values stored somewhere long lived. */
+lval* lval_promote(lval* v) {
+  /* Even old vectors can have had young values written into their nodes */
+  if (!LVAL_IS_FIXNUM(v) && v->type == LVAL_VEC) {
+    vnode_promote(v->root, v->shift);
+    vnode_promote(v->tail, 0);
+  }
+
+  if (LVAL_IS_FIXNUM(v) || v->gen == LGEN_OLD) { return v; }
+
+  /* Runs of young cells are copied in a loop, up to the first old one */
+  if (v->type == LVAL_CONS) {
+    lval* first = NULL;
+    lval** link = &first;
+    while (!LVAL_IS_FIXNUM(v) && v->type == LVAL_CONS && v->gen != LGEN_OLD) {
+      lval* x = lval_new_old(LVAL_CONS);
+      x->car = lval_promote(lval_copy(v->car));
+      *link = x;
+      link = &x->cdr;
+
+      lval* cdr = lval_copy(v->cdr);
+      lval_del(v);
+      v = cdr;
+    }
+    *link = lval_promote(v);
+    return first;
+  }
+
+  lval* x = lval_new_old(v->type);
+
+  switch (v->type) {
+    case LVAL_NUM:
+      x->num = v->num;
+      x->big = lbig_copy(v->big);
+      break;
+
+    case LVAL_DBL: x->dbl = v->dbl; break;
+
+    case LVAL_ARR:
+      x->alen = v->alen;
+      x->adbl = v->adbl;
+      x->ints = malloc(sizeof(long) * v->alen);
+      memcpy(x->ints, v->ints, sizeof(long) * v->alen);
+      break;
+
+    case LVAL_FUN:;
+      x->builtin = v->builtin;
+      x->memo = v->memo;
+      if (x->memo) { x->memo->refs++; }
+      if (!v->builtin) {
+        x->env = lenv_copy(v->env);
+        for (int i = 0; i < x->env->count; i++) {
+          x->env->vals[i] = lval_promote(x->env->vals[i]);
+        }
+        x->formals = lval_promote(lval_copy(v->formals));
+        x->body = lval_promote(lval_copy(v->body));
+
+        /* Constants are promoted in place, the code itself is shared */
+        x->code = v->code;
+        if (x->code) {
+          x->code->refs++;
+          for (int i = 0; i < x->code->nconsts; i++) {
+            x->code->consts[i] = lval_promote(x->code->consts[i]);
+          }
+        }
+      }
+      break;
+
+    case LVAL_ERR:
+      x->err = malloc(strlen(v->err) + 1);
+      strcpy(x->err, v->err);
+      break;
+
+    case LVAL_SYM:
+      x->sym = v->sym;
+      break;
+
+    case LVAL_STR:
+      lval_str_share(x, v);
+      break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      x->count = v->count;
+      x->cell = NULL;
+      x->base = NULL;
+      lval_resize(x, 0, x->count);
+      for (int i = 0; i < x->count; i++) {
+        x->cell[i] = lval_promote(lval_copy(v->cell[i]));
+      }
+      break;
+
+    case LVAL_VEC:
+      lval_vec_share(x, v);
+      break;
+  }
+
+  lval_del(v);
+  return x;
+}
+
+int lcode_emit(lcode* c, int op) {
+  c->count++;
+  c->ops = realloc(c->ops, sizeof(int) * c->count);
+  c->ops[c->count-1] = op;
+  return c->count-1;
+}
+
+int lcode_const(lcode* c, lval* v) {
+  c->nconsts++;
+  c->consts = realloc(c->consts, sizeof(lval*) * c->nconsts);
+  c->consts[c->nconsts-1] = lval_copy(v);
+  return c->nconsts-1;
+}
+
+void lcode_push(lcode* c, int n) {
+  c->depth += n;
+  if (c->depth > c->max_depth) { c->max_depth = c->depth; }
+}
+
+void lcode_compile_sexpr(lcode* c, lval* v, int tail);
+void lcode_compile_sexpr_slow(lcode* c, lval* v, int tail);
+
+/* Adds an inline cache for 'sym', filled in already if it is global */
+int lcode_cache(lcode* c, char* sym) {
+  c->ncaches++;
+  c->caches = realloc(c->caches, sizeof(lcache) * c->ncaches);
+  lcache* ic = &c->caches[c->ncaches-1];
+  ic->version = -1;
+  ic->val = NULL;
+
+  lsym* info = SYM_INFO(sym);
+  if (info->frames == 0 && info->global >= 0) {
+    ic->version = lenv_version;
+    ic->val = lenv_global->vals[info->global];
+  }
+  return c->ncaches-1;
+}
+
+/* Builtins without side effects, which can be called while compiling */
+int lcode_is_pure(lbuiltin f) {
+  return f == builtin_add || f == builtin_sub
+    || f == builtin_mul || f == builtin_div
+    || f == builtin_gt || f == builtin_lt
+    || f == builtin_ge || f == builtin_le
+    || f == builtin_and || f == builtin_or || f == builtin_not
+    || f == builtin_eq || f == builtin_ne;
+}
+
+lval* lcode_fold_expr(lcode* c, lfold* f, lval* v);
+
+void lcode_unfoldable(lcode* c, lval* v) {
+  c->nunfolded++;
+  c->unfolded = realloc(c->unfolded, sizeof(lval*) * c->nunfolded);
+  c->unfolded[c->nunfolded-1] = v;
+}
+
+/* Computes the call 'v' now if it only applies pure builtins to */
+/* constants, adding the symbols it looked up to 'f'. Returns NULL if */
+/* it can't. */
+lval* lcode_fold_call(lcode* c, lfold* f, lval* v) {
+  if (v->count < 2 || LTYPE(v->cell[0]) != LVAL_SYM) { return NULL; }
+  lsym* info = SYM_INFO(v->cell[0]->sym);
+  if (info->global < 0) { return NULL; }
+  lval* g = lenv_global->vals[info->global];
+  if (LTYPE(g) != LVAL_FUN || !lcode_is_pure(g->builtin)) { return NULL; }
+
+  for (int i = 0; i < c->nunfolded; i++) {
+    if (c->unfolded[i] == v) { return NULL; }
+  }
+
+  lval* a = lval_sexpr();
+  for (int i = 1; i < v->count; i++) {
+    lval* x = lcode_fold_expr(c, f, v->cell[i]);
+    if (!x) {
+      lval_del(a);
+      lcode_unfoldable(c, v);
+      return NULL;
+    }
+    lval_add(a, x);
+  }
+
+  /* Errors are left to happen at run time */
+  lval* r = g->builtin(lenv_global, a);
+  if (LTYPE(r) == LVAL_ERR) {
+    lval_del(r);
+    lcode_unfoldable(c, v);
+    return NULL;
+  }
+
+  f->count++;
+  f->syms = realloc(f->syms, sizeof(char*) * f->count);
+  f->funs = realloc(f->funs, sizeof(lbuiltin) * f->count);
+  f->syms[f->count-1] = v->cell[0]->sym;
+  f->funs[f->count-1] = g->builtin;
+  return r;
+}
+
+lval* lcode_fold_expr(lcode* c, lfold* f, lval* v) {
+  switch (LTYPE(v)) {
+    case LVAL_NUM:
+    case LVAL_DBL:
+    case LVAL_STR:
+    case LVAL_QEXPR:
+      return lval_copy(v);
+    case LVAL_SEXPR:
+      return lcode_fold_call(c, f, v);
+    default:
+      return NULL;
+  }
+}
+
+/* Folds 'v', evaluated as a call if 'call' is set, returning the index */
+/* of its assumptions and setting 'r' to its value, or returning -1 */
+int lcode_fold(lcode* c, lval* v, int call, lval** r) {
+  lfold f = { lenv_version, 0, NULL, NULL };
+  *r = call ? lcode_fold_call(c, &f, v) : lcode_fold_expr(c, &f, v);
+  if (!*r) {
+    free(f.syms);
+    free(f.funs);
+    return -1;
+  }
+
+  c->nfolds++;
+  c->folds = realloc(c->folds, sizeof(lfold) * c->nfolds);
+  c->folds[c->nfolds-1] = f;
+  return c->nfolds-1;
+}
+
+/* Whether the builtins a fold used are still the ones in scope */
+int lcode_fold_valid(lfold* f) {
+  /* Frames binding the symbols would shadow the builtins */
+  for (int i = 0; i < f->count; i++) {
+    if (SYM_INFO(f->syms[i])->frames) { return 0; }
+  }
+  if (f->version == lenv_version) { return 1; }
+
+  /* Something has been defined since, check the globals again */
+  for (int i = 0; i < f->count; i++) {
+    lsym* info = SYM_INFO(f->syms[i]);
+    lval* g = lenv_global->vals[info->global];
+    if (LTYPE(g) != LVAL_FUN || g->builtin != f->funs[i]) { return 0; }
+  }
+  f->version = lenv_version;
+  return 1;
+}
+
+/* Formals are bound into the frame in order, so the slot of a formal is */
+/* its position among the distinct formals. Returns -1 for other symbols. */
+int lcode_local(lcode* c, char* sym) {
+  int slot = 0;
+  for (int i = 0; i < c->formals->count; i++) {
+    char* f = c->formals->cell[i]->sym;
+    if (f == sym_amp) { continue; }
+    if (f == sym) { return slot; }
+
+    /* Repeated formals rebind the same slot */
+    int seen = 0;
+    for (int j = 0; j < i && !seen; j++) {
+      seen = c->formals->cell[j]->sym == f;
+    }
+    if (!seen) { slot++; }
+  }
+  return -1;
+}
+
+void lcode_compile_expr(lcode* c, lval* v) {
+  int slot;
+
+  switch (LTYPE(v)) {
+    /* Nested S-Expressions are compiled in place */
+    case LVAL_SEXPR: lcode_compile_sexpr(c, v, 0); return;
+
+    case LVAL_SYM:
+      slot = lcode_local(c, v->sym);
+      if (slot >= 0) {
+        lcode_emit(c, OP_LOCAL);
+        lcode_emit(c, lcode_const(c, v));
+        lcode_emit(c, slot);
+      } else {
+        lcode_emit(c, OP_SYM);
+        lcode_emit(c, lcode_const(c, v));
+        lcode_emit(c, lcode_cache(c, v->sym));
+      }
+      lcode_push(c, 1);
+      return;
+
+    /* Everything else evaluates to itself */
+    default: lcode_emit(c, OP_CONST); break;
+  }
+
+  lcode_emit(c, lcode_const(c, v));
+  lcode_push(c, 1);
+}
+
+/* Matches (if cond {then} {else}) */
+int lcode_is_if(lval* v) {
+  return v->count == 4
+    && LTYPE(v->cell[0]) == LVAL_SYM
+    && v->cell[0]->sym == sym_if
+    && LTYPE(v->cell[2]) == LVAL_QEXPR
+    && LTYPE(v->cell[3]) == LVAL_QEXPR;
+}
+
+/* Compiles an if after 'if' itself has been pushed */
+void lcode_compile_if(lcode* c, lval* v, int tail) {
+  lcode_compile_expr(c, v->cell[1]);
+
+  /* Keep the branches as constants in case 'if' has been redefined */
+  lcode_emit(c, OP_IF);
+  lcode_emit(c, lcode_const(c, v->cell[2]));
+  lcode_emit(c, lcode_const(c, v->cell[3]));
+  int to_else = lcode_emit(c, 0);
+  int to_end = lcode_emit(c, 0);
+  lcode_push(c, 2);
+  c->depth -= 4;
+
+  /* Branches are evaluated as S-Expressions, just like builtin_if */
+  lcode_compile_sexpr(c, v->cell[2], tail);
+  lcode_emit(c, OP_JUMP);
+  int skip_else = lcode_emit(c, 0);
+  c->depth--;
+
+  c->ops[to_else] = c->count;
+  lcode_compile_sexpr(c, v->cell[3], tail);
+  c->ops[to_end] = c->count;
+  c->ops[skip_else] = c->count;
+}
+
+/* 'tail' is set when the value is returned straight from the body */
+void lcode_compile_sexpr(lcode* c, lval* v, int tail) {
+  lval* k;
+  int f = lcode_fold(c, v, 1, &k);
+
+  /* Constant expressions are computed once, unless their builtins */
+  /* have been redefined or shadowed */
+  if (f >= 0) {
+    lcode_emit(c, OP_FOLD);
+    lcode_emit(c, lcode_const(c, k));
+    lcode_emit(c, f);
+    int skip = lcode_emit(c, 0);
+    lval_del(k);
+
+    lcode_push(c, 1);
+    c->depth--;
+    lcode_compile_sexpr_slow(c, v, tail);
+    c->ops[skip] = c->count;
+    return;
+  }
+
+  lcode_compile_sexpr_slow(c, v, tail);
+}
+
+void lcode_compile_sexpr_slow(lcode* c, lval* v, int tail) {
+  if (lcode_is_if(v)) {
+    lcode_compile_expr(c, v->cell[0]);
+
+    lval* k;
+    int f = lcode_fold(c, v->cell[1], 0, &k);
+    if (f < 0 || LTYPE(k) != LVAL_NUM) {
+      if (f >= 0) { lval_del(k); }
+      lcode_compile_if(c, v, tail);
+      return;
+    }
+
+    /* With a constant condition only the branch taken is compiled */
+    /* inline. When the fold no longer holds the if is made as an */
+    /* ordinary call, so neither branch is compiled a second time. */
+    lcode_emit(c, OP_IFK);
+    lcode_emit(c, f);
+    int to_full = lcode_emit(c, 0);
+    c->depth--;
+    lcode_compile_sexpr(c, LNUM(k) ? v->cell[2] : v->cell[3], tail);
+    lcode_emit(c, OP_JUMP);
+    int to_end = lcode_emit(c, 0);
+    lval_del(k);
+
+    c->ops[to_full] = c->count;
+    for (int i = 1; i < v->count; i++) {
+      lcode_compile_expr(c, v->cell[i]);
+    }
+    lcode_emit(c, tail ? OP_TAIL : OP_EVAL);
+    lcode_emit(c, v->count);
+    c->depth -= v->count;
+    lcode_push(c, 1);
+    c->ops[to_end] = c->count;
+    return;
+  }
+
+  for (int i = 0; i < v->count; i++) {
+    lcode_compile_expr(c, v->cell[i]);
+  }
+  lcode_emit(c, tail ? OP_TAIL : OP_EVAL);
+  lcode_emit(c, v->count);
+  c->depth -= v->count;
+  lcode_push(c, 1);
+}
+
+lcode* lcode_compile(lval* formals, lval* body) {
+  lcode* c = malloc(sizeof(lcode));
+  c->refs = 1;
+  c->count = 0;
+  c->ops = NULL;
+  c->nconsts = 0;
+  c->consts = NULL;
+  c->depth = 0;
+  c->max_depth = 0;
+  c->ncaches = 0;
+  c->caches = NULL;
+  c->nfolds = 0;
+  c->folds = NULL;
+  c->formals = formals;
+  c->nunfolded = 0;
+  c->unfolded = NULL;
+
+  /* The body is evaluated as an S-Expression */
+  lcode_compile_sexpr(c, body, 1);
+  lcode_emit(c, OP_RET);
+  c->formals = NULL;
+  free(c->unfolded);
+  c->unfolded = NULL;
+
+  return c;
+}
+
+/* Frees everything but the constants */
+void lcode_free(lcode* c) {
+  for (int i = 0; i < c->nfolds; i++) {
+    free(c->folds[i].syms);
+    free(c->folds[i].funs);
+  }
+  free(c->folds);
+  free(c->consts);
+  free(c->caches);
+  free(c->ops);
+  free(c);
+}
+
+void lcode_del(lcode* c) {
+  if (--c->refs > 0) { return; }
+
+  for (int i = 0; i < c->nconsts; i++) {
+    lval_del(c->consts[i]);
+  }
+  lcode_free(c);
+}
+
+/* Same as lval_eval_sexpr on n already evaluated values */
+lval* lcode_eval(lenv* e, lval** xs, int n) {
+
+  /* Error checking */
+  for (int i = 0; i < n; i++) {
+    if (LTYPE(xs[i]) == LVAL_ERR) {
+      lval* err = xs[i];
+      for (int j = 0; j < n; j++) {
+        if (j != i) { lval_del(xs[j]); }
+      }
+      return err;
+    }
+  }
+
+  /* Empty expression */
+  if (n == 0) { return lval_sexpr(); }
+
+  /* Single expression */
+  if (n == 1) { return xs[0]; }
+
+  /* Ensure first element is a function */
+  lval* f = xs[0];
+  if (LTYPE(f) != LVAL_FUN) {
+    lval* err = lval_err(
+        "S-Expression starts with incorrect type. "
+        "Got %s, expected %s.",
+        ltype_name(LTYPE(f)), ltype_name(LVAL_FUN));
+    for (int i = 0; i < n; i++) { lval_del(xs[i]); }
+    return err;
+  }
+
+  /* Remaining values become the argument list */
+  lval* a = lval_sexpr();
+  lval_resize(a, 0, n-1);
+  a->count = n-1;
+  memcpy(a->cell, &xs[1], sizeof(lval*) * a->count);
+
+  return lval_call(e, f, a);
+}
+
+/* Value stack shared by all running VM frames */
+lval** vm_stack = NULL;
+int vm_top = 0;
+int vm_size = 0;
+
+void vm_reserve(int n) {
+  if (vm_top + n <= vm_size) { return; }
+  while (vm_top + n > vm_size) { vm_size = vm_size ? vm_size * 2 : 256; }
+  vm_stack = realloc(vm_stack, sizeof(lval*) * vm_size);
+}
+
+/* Pops n values and pushes the result of evaluating them */
+void vm_eval(lenv* e, int n) {
+  vm_top -= n;
+  lval* x = lcode_eval(e, &vm_stack[vm_top], n);
+  vm_stack[vm_top++] = x;
+}
+
+/* Replaces a tail call to 'if' or 'eval' on the top n values with the */
+/* evaluated children of its expression. Returns how many were pushed, */
+/* or -1 if the call is anything else */
+int vm_tail_expand(lenv* e, int n) {
+  lval** xs = &vm_stack[vm_top-n];
+  lval* f = xs[0];
+  if (n < 2 || LTYPE(f) != LVAL_FUN || f->memo) { return -1; }
+  if (f->builtin != builtin_if && f->builtin != builtin_eval) { return -1; }
+  for (int i = 1; i < n; i++) {
+    if (LTYPE(xs[i]) == LVAL_ERR) { return -1; }
+  }
+
+  lval* a = lval_sexpr();
+  lval_resize(a, 0, n-1);
+  a->count = n-1;
+  memcpy(a->cell, &xs[1], sizeof(lval*) * a->count);
+  vm_top -= n;
+
+  lval* x = (f->builtin == builtin_if) ? lval_if_branch(a) : lval_eval_arg(a);
+  lval_del(f);
+  if (LTYPE(x) == LVAL_ERR) {
+    vm_stack[vm_top++] = x;
+    return 1;
+  }
+
+  /* Nested frames may grow the stack but never shrink it below this */
+  int count = x->count;
+  vm_reserve(count);
+  for (int i = 0; i < count; i++) {
+    lval* y = lval_eval(e, lval_copy(x->cell[i]));
+    vm_stack[vm_top++] = y;
+  }
+  lval_del(x);
+  return count;
+}
+
+lval* lcode_run(lenv* e, lcode* c) {
+  /* Functions entered by tail calls, which own their environments */
+  lval* frames = NULL;
+  int pc = 0;
+
+  vm_reserve(c->max_depth);
+
+  while (1) {
+    switch (c->ops[pc++]) {
+      case OP_CONST:
+        vm_stack[vm_top++] = lval_copy(c->consts[c->ops[pc++]]);
+        break;
+
+      case OP_SYM:;
+        lval* s = c->consts[c->ops[pc++]];
+        lcache* ic = &c->caches[c->ops[pc++]];
+        lsym* info = SYM_INFO(s->sym);
+
+        /* Frames could bind the symbol too, see lenv_get */
+        if (info->frames == 0 && ic->version == lenv_version) {
+          vm_stack[vm_top++] = lval_copy(ic->val);
+          break;
+        }
+
+        vm_stack[vm_top++] = lenv_get(e, s);
+        if (info->frames == 0 && info->global >= 0) {
+          ic->version = lenv_version;
+          ic->val = lenv_global->vals[info->global];
+        }
+        break;
+
+      case OP_LOCAL:;
+        /* Fall back to a lookup if the frame isn't laid out as expected */
+        lval* k = c->consts[c->ops[pc++]];
+        int slot = c->ops[pc++];
+        if (slot < e->count && e->syms[slot] == k->sym) {
+          vm_stack[vm_top++] = lval_copy(e->vals[slot]);
+        } else {
+          vm_stack[vm_top++] = lenv_get(e, k);
+        }
+        break;
+
+      case OP_EVAL:
+        vm_eval(e, c->ops[pc++]);
+        break;
+
+      case OP_TAIL:;
+        int n = c->ops[pc++];
+
+        /* 'if' and 'eval' leave an expression whose call is in tail position too */
+        for (int m; (m = vm_tail_expand(e, n)) >= 0; ) { n = m; }
+        lval** xs = &vm_stack[vm_top-n];
+
+        /* Only complete calls to compiled lambdas reuse the frame */
+        int reuse = n >= 2 && LTYPE(xs[0]) == LVAL_FUN
+          && !xs[0]->builtin && xs[0]->code;
+        for (int i = 0; i < n && reuse; i++) {
+          reuse = LTYPE(xs[i]) != LVAL_ERR;
+        }
+        if (!reuse) { vm_eval(e, n); break; }
+
+        /* Remaining values become the argument list */
+        lval* f = lval_unshare(xs[0]);
+        lval* a = lval_sexpr();
+        lval_resize(a, 0, n-1);
+        a->count = n-1;
+        memcpy(a->cell, &xs[1], sizeof(lval*) * a->count);
+        vm_top -= n;
+
+        lval* x = lval_bind(e, f, a);
+        if (x) {
+          lval_del(f);
+          vm_stack[vm_top++] = x;
+          break;
+        }
+
+        /* Start over with the callee's code in its own frame */
+        e = lval_enter_tail(e, f, &frames);
+        c = f->code;
+        pc = 0;
+        vm_reserve(c->max_depth);
+        break;
+
+      case OP_IF:;
+        lval* g = vm_stack[vm_top-2];
+        lval* cond = vm_stack[vm_top-1];
+        int then_k = c->ops[pc++];
+        int else_k = c->ops[pc++];
+        int to_else = c->ops[pc++];
+        int to_end = c->ops[pc++];
+
+        if (LTYPE(g) == LVAL_FUN && g->builtin == builtin_if
+            && LTYPE(cond) == LVAL_NUM) {
+          /* Fall through to the 'then' code or jump to the 'else' code */
+          if (!LNUM(cond)) { pc = to_else; }
+          lval_del(g);
+          lval_del(cond);
+          vm_top -= 2;
+        } else {
+          /* Otherwise call whatever 'if' is with the original arguments */
+          vm_stack[vm_top++] = lval_copy(c->consts[then_k]);
+          vm_stack[vm_top++] = lval_copy(c->consts[else_k]);
+          vm_eval(e, 4);
+          pc = to_end;
+        }
+        break;
+
+      case OP_FOLD:;
+        int fv = c->ops[pc++];
+        int ff = c->ops[pc++];
+        int skip = c->ops[pc++];
+        if (lcode_fold_valid(&c->folds[ff])) {
+          vm_stack[vm_top++] = lval_copy(c->consts[fv]);
+          pc = skip;
+        }
+        break;
+
+      case OP_IFK:;
+        lval* h = vm_stack[vm_top-1];
+        int fk = c->ops[pc++];
+        int to_full = c->ops[pc++];
+        if (LTYPE(h) == LVAL_FUN && h->builtin == builtin_if
+            && lcode_fold_valid(&c->folds[fk])) {
+          lval_del(h);
+          vm_top--;
+        } else {
+          pc = to_full;
+        }
+        break;
+
+      case OP_JUMP:
+        pc = c->ops[pc];
+        break;
+
+      case OP_RET:;
+        lval* r = vm_stack[--vm_top];
+        if (frames) { lval_del(frames); }
+        return r;
+    }
+  }
+}
+
+/* Values held by C code across a safepoint */
+lval** gc_roots = NULL;
+int gc_nroots = 0;
+
+void gc_push_root(lval* v) {
+  gc_nroots++;
+  gc_roots = realloc(gc_roots, sizeof(lval*) * gc_nroots);
+  gc_roots[gc_nroots-1] = v;
+}
+
+void gc_pop_root(void) {
+  gc_nroots--;
+}
+
+/* Values that have been marked but whose children have not */
+lval** gc_gray = NULL;
+int gc_ngray = 0;
+int gc_gray_size = 0;
+
+void gc_mark(lval* v) {
+  if (LVAL_IS_FIXNUM(v) || v->mark) { return; }
+  v->mark = 1;
+
+  if (gc_ngray == gc_gray_size) {
+    gc_gray_size = gc_gray_size ? gc_gray_size * 2 : 256;
+    gc_gray = realloc(gc_gray, sizeof(lval*) * gc_gray_size);
+  }
+  gc_gray[gc_ngray++] = v;
+}
+
+void gc_mark_lenv(lenv* e) {
+  if (e->mark) { return; }
+  e->mark = 1;
+
+  /* Parents are not followed, they are only valid during a call */
+  for (int i = 0; i < e->count; i++) {
+    gc_mark(e->vals[i]);
+  }
+}
+
+/* Nodes shared by several vectors are only traced once per collection */
+int gc_epoch = 0;
+
+void gc_mark_vnode(lvnode* n, int shift) {
+  if (!n || n->mark == gc_epoch) { return; }
+  n->mark = gc_epoch;
+
+  for (int i = 0; i < VEC_WIDTH; i++) {
+    if (shift == 0 && n->vals[i]) { gc_mark(n->vals[i]); }
+    if (shift > 0) { gc_mark_vnode(n->kids[i], shift - VEC_BITS); }
+  }
+}
+
+void gc_trace(void) {
+  while (gc_ngray) {
+    lval* v = gc_gray[--gc_ngray];
+
+    switch (v->type) {
+      case LVAL_FUN:
+        if (v->memo) {
+          gc_mark(v->memo->fun);
+          for (int i = 0; i < v->memo->nsets * MEMO_WAYS; i++) {
+            if (v->memo->entries[i].args) {
+              gc_mark(v->memo->entries[i].args);
+              gc_mark(v->memo->entries[i].val);
+            }
+          }
+        }
+        if (!v->builtin) {
+          gc_mark_lenv(v->env);
+          gc_mark(v->formals);
+          gc_mark(v->body);
+          for (int i = 0; v->code && i < v->code->nconsts; i++) {
+            gc_mark(v->code->consts[i]);
+          }
+        }
+        break;
+
+      case LVAL_QEXPR:
+      case LVAL_SEXPR:
+        if (v->base) { gc_mark(v->base); break; }
+        for (int i = 0; i < v->count; i++) {
+          gc_mark(v->cell[i]);
+        }
+        break;
+
+      case LVAL_CONS:
+        gc_mark(v->car);
+        gc_mark(v->cdr);
+        break;
+
+      case LVAL_VEC:
+        gc_mark_vnode(v->root, v->shift);
+        gc_mark_vnode(v->tail, 0);
+        break;
+    }
+  }
+}
+
+/* Garbage is freed without lval_del, so references it holds on */
+/* survivors are dropped by hand */
+void gc_release(lval* v) {
+  if (!LVAL_IS_FIXNUM(v) && v->mark) { v->refs--; }
+}
+
+void gc_release_children(lval* v) {
+  switch (v->type) {
+    case LVAL_FUN:
+      if (v->memo && --v->memo->refs == 0) {
+        lmemo* m = v->memo;
+        gc_release(m->fun);
+        for (int i = 0; i < m->nsets * MEMO_WAYS; i++) {
+          if (m->entries[i].args) {
+            gc_release(m->entries[i].args);
+            gc_release(m->entries[i].val);
+          }
+        }
+        free(m->entries);
+        free(m);
+      }
+      if (!v->builtin) {
+        gc_release(v->formals);
+        gc_release(v->body);
+        if (v->code && --v->code->refs == 0) {
+          for (int i = 0; i < v->code->nconsts; i++) {
+            gc_release(v->code->consts[i]);
+          }
+          lcode_free(v->code);
+        }
       }
       break;
 
-    /* Copy strings using malloc and strcpy */
-    case LVAL_ERR:
-      x->err = malloc(strlen(v->err) + 1);
-      strcpy(x->err, v->err);
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      if (v->base) { gc_release(v->base); break; }
+      for (int i = 0; i < v->count; i++) {
+        gc_release(v->cell[i]);
+      }
       break;
 
-    case LVAL_SYM:
-      x->sym = malloc(strlen(v->sym) + 1);
-      strcpy(x->sym, v->sym);
+    case LVAL_CONS:
+      gc_release(v->car);
+      gc_release(v->cdr);
       break;
 
-    case LVAL_STR:
-      x->str = malloc(strlen(v->str) + 1);
-      strcpy(x->str, v->str);
+    case LVAL_VEC:
+      vnode_del(v->root, v->shift, gc_release);
+      vnode_del(v->tail, 0, gc_release);
       break;
+  }
+}
 
-    /* Copy lists by copying each sub-expression */
-    case LVAL_SEXPR:
+void gc_free(lval* v) {
+  switch (v->type) {
+    case LVAL_NUM: free(v->big); break;
+    case LVAL_ERR: free(v->err); break;
+    case LVAL_STR: lval_str_free(v); break;
+    case LVAL_ARR: free(v->ints); break;
     case LVAL_QEXPR:
-      x->count = v->count;
-      x->cell = malloc(sizeof(lval*) * x->count);
+    case LVAL_SEXPR:
+      if (!v->base) { cells_free(v->cell, lval_capacity(v->count)); }
+      break;
+  }
 
-      for (int i = 0; i < x->count; i++) {
-        x->cell[i] = lval_copy(v->cell[i]);
+  lval_free(v);
+}
+
+void gc_sweep(void) {
+  /* Drop references from garbage to survivors */
+  for (lslab* s = lval_pool.slabs; s; s = s->next) {
+    for (size_t i = 0; i < s->count; i++) {
+      lval* v = POOL_SLOT(s, &lval_pool, i);
+      if (v->refs > 0 && !v->mark) { gc_release_children(v); }
+    }
+  }
+
+  for (lblock* b = nursery_blocks; b; b = b->next) {
+    for (int i = 0; i < b->used; i++) {
+      lval* v = &b->slots[i];
+      if (v->refs && !v->mark) { gc_release_children(v); }
+    }
+  }
+
+  for (lslab* s = lenv_pool.slabs; s; s = s->next) {
+    for (size_t i = 0; i < s->count; i++) {
+      lenv* e = POOL_SLOT(s, &lenv_pool, i);
+      if (e->mark) { continue; }
+      for (int j = 0; j < e->count; j++) {
+        gc_release(e->vals[j]);
       }
-    break;
+    }
   }
 
-  return x;
+  /* Free the garbage and unmark the survivors */
+  for (lslab* s = lval_pool.slabs; s; s = s->next) {
+    for (size_t i = 0; i < s->count; i++) {
+      lval* v = POOL_SLOT(s, &lval_pool, i);
+      if (v->refs <= 0) { continue; }
+      if (v->mark) {
+        v->mark = 0;
+      } else {
+        gc_free(v);
+      }
+    }
+  }
+
+  for (lblock* b = nursery_blocks; b; b = b->next) {
+    for (int i = 0; i < b->used; i++) {
+      lval* v = &b->slots[i];
+      if (!v->refs) { continue; }
+      if (v->mark) {
+        v->mark = 0;
+      } else {
+        gc_free(v);
+      }
+    }
+  }
+
+  for (lslab* s = lenv_pool.slabs; s; s = s->next) {
+    for (size_t i = 0; i < s->count; i++) {
+      lenv* e = POOL_SLOT(s, &lenv_pool, i);
+      if (e->count < 0) { continue; }
+      if (e->mark) {
+        e->mark = 0;
+      } else {
+        lenv_free(e);
+      }
+    }
+  }
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
+/* Frees everything unreachable from the global environment, the VM */
+/* stack and the registered roots. This reclaims whatever reference */
+/* counting has leaked. */
+void gc_collect(lenv* e) {
+  while (e->parent) { e = e->parent; }
+
+  gc_epoch++;
+  gc_mark_lenv(e);
+  for (int i = 0; i < gc_nroots; i++) { gc_mark(gc_roots[i]); }
+  for (int i = 0; i < vm_top; i++) { gc_mark(vm_stack[i]); }
+  gc_trace();
+  gc_sweep();
+
+  /* Wait for the heap to double before collecting again */
+  gc_threshold = gc_live * 2 > 10000 ? gc_live * 2 : 10000;
+}
 
-  /* If builtin then simply call that */
-  if (f->builtin) { return f->builtin(e, a); }
+/* Called between top level expressions, where every value still in use */
+/* is reachable from a root */
+void gc_safepoint(lenv* e) {
+  if (eval_depth == 0 && arena_depth == 0 && gc_live > gc_threshold) {
+    gc_collect(e);
+  }
+}
+
+void arena_drop(lval* v) {
+  if (LVAL_IS_FIXNUM(v) || v->gen != LGEN_ARENA) { lval_del(v); }
+}
+
+/* Drops the references an arena lval holds outside of the arena, as */
+/* lval_del would have done */
+void arena_release(lval* v) {
+  switch (v->type) {
+    case LVAL_FUN:
+      if (v->memo) { lmemo_del(v->memo); }
+      if (!v->builtin) {
+        lenv_del(v->env);
+        arena_drop(v->formals);
+        arena_drop(v->body);
+        if (v->code) { lcode_del(v->code); }
+      }
+      break;
+
+    case LVAL_NUM: free(v->big); break;
+    case LVAL_ERR: free(v->err); break;
+    case LVAL_STR: lval_str_free(v); break;
+
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      if (v->base) { arena_drop(v->base); break; }
+      for (int i = 0; i < v->count; i++) {
+        arena_drop(v->cell[i]);
+      }
+      break;
+
+    case LVAL_CONS:
+      arena_drop(v->car);
+      arena_drop(v->cdr);
+      break;
+
+    case LVAL_VEC:
+      vnode_del(v->root, v->shift, arena_drop);
+      vnode_del(v->tail, 0, arena_drop);
+      break;
+
+    case LVAL_ARR: free(v->ints); break;
+  }
+}
+
+/* Frees everything allocated since the region was opened in one go */
+void arena_close(larena m) {
+  if (!use_arena) { return; }
+
+  for (int i = m.top; i < arena_top; i++) {
+    arena_release(&arena_lvals[i / ARENA_CHUNK_LVALS][i % ARENA_CHUNK_LVALS]);
+  }
+
+  arena_top = m.top;
+  arena_chunk = m.chunk;
+  arena_offset = m.offset;
+  arena_depth--;
+}
+
+/* Binds arguments into the environment of unshared lambda 'f'. Returns */
+/* NULL once every formal is bound, otherwise an error or the partial */
+/* function */
+lval* lval_bind(lenv* e, lval* f, lval* a) {
 
   /* Record argument counts */
   int given = a->count;
@@ -1148,10 +5405,11 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
     lval* sym = lval_pop(f->formals, 0);
 
     /* special case to deal with '&'  */
-    if (strcmp(sym->sym, "&") == 0) {
+    if (sym->sym == sym_amp) {
 
       /* Ensure '&' is followed by another symbol */
       if (f->formals->count != 1) {
+        lval_del(sym);
         lval_del(a);
         return lval_err("Function format invalid. "
             "Symbol '&' not followed by single symbol.");
@@ -1181,7 +5439,7 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
 
   /* If '&' remains in formal list bind to empty list */
   if (f->formals->count > 0 &&
-      strcmp(f->formals->cell[0]->sym, "&") == 0) {
+      f->formals->cell[0]->sym == sym_amp) {
 
     /* Check to ensure that & is not passed invalidly */
     if (f->formals->count != 2) {
@@ -1202,22 +5460,87 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
     lval_del(val);
   }
 
-  /* If all formals have been bound evaluate */
+  /* If all formals have been bound the body can be evaluated */
   if (f->formals->count == 0) {
-    /* Set the parent environment */
+    return NULL;
+  } else {
+    /* Otherwise return partially evaluated function */
+    return lval_copy(f);
+  }
+}
+
+/* Does 'e' bind every symbol that 'p' binds */
+int lenv_shadows(lenv* e, lenv* p) {
+  for (int i = 0; i < p->count; i++) {
+    if (lenv_find(e, p->syms[i]) < 0) { return 0; }
+  }
+  return 1;
+}
+
+/* Enters lambda 'f' from a call in tail position of frame 'e', taking */
+/* ownership of it in 'frames'. Scope is dynamic so 'e' normally stays */
+/* the parent, but a frame the callee completely shadows can be skipped */
+/* and freed, which keeps self-recursive loops in constant memory. */
+lenv* lval_enter_tail(lenv* e, lval* f, lval** frames) {
+  if (!*frames) { *frames = lval_sexpr(); }
+  lval* fs = *frames;
+
+  if (e->parent && lenv_shadows(f->env, e)) {
+    f->env->parent = e->parent;
+
+    /* Nothing else refers to the frame being left */
+    if (fs->count && fs->cell[fs->count-1]->env == e) {
+      lval_del(lval_pop(fs, fs->count-1));
+    }
+  } else {
     f->env->parent = e;
+  }
+
+  lval_add(fs, f);
+  return f->env;
+}
+
+/* Calls 'f' with arguments 'a', consuming both */
+lval* lval_call(lenv* e, lval* f, lval* a) {
+  lval* x;
+
+  /* Memoized functions look up their arguments first */
+  if (f->memo) { return lval_memo_call(e, f, a); }
+
+  /* If builtin then simply call that */
+  if (f->builtin) {
+    x = f->builtin(e, a);
+    lval_del(f);
+    return x;
+  }
 
+  /* Bind the arguments, stopping on errors or partial application */
+  f = lval_unshare(f);
+  x = lval_bind(e, f, a);
+  if (x) {
+    lval_del(f);
+    return x;
+  }
+
+  /* Set the parent environment */
+  f->env->parent = e;
+
+  if (f->code) {
+    /* Run the compiled body if there is one */
+    x = lcode_run(f->env, f->code);
+  } else {
     /*Evaluate the body */
-    return builtin_eval(f->env,
+    x = builtin_eval(f->env,
       lval_add(lval_sexpr(), lval_copy(f->body)));
-  } else {
-    /* Otherwise return partially evaluated function */
-    return lval_copy(f);
   }
+
+  lval_del(f);
+  return x;
 }
 
 int main(int argc, char** argv) {
   Comment = mpc_new("comment");
+  Double = mpc_new("double");
   Expr = mpc_new("expr");
   Lispy = mpc_new("lispy");
   Number = mpc_new("number");
@@ -1228,22 +5551,37 @@ int main(int argc, char** argv) {
 
   mpca_lang(MPCA_LANG_DEFAULT,
     "                                                 \
+      double  : /-?[0-9]+(\\.[0-9]+([eE][-+]?[0-9]+)?|[eE][-+]?[0-9]+)/ ; \
       number  : /-?[0-9]+/ ;                          \
       symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\\\|=<>!&]+/ ; \
       string  : /\"(\\\\.|[^\"])*\"/ ;                \
       comment : /;[^\\r\\n]*/ ;                       \
       sexpr   : '(' <expr>* ')' ;                     \
       qexpr   : '{' <expr>* '}' ;                     \
-      expr    : <number>  | <symbol> | <string>       \
-              | <comment> | <sexpr>  | <qexpr>;       \
+      expr    : <double>  | <number> | <symbol>       \
+              | <string>  | <comment>                 \
+              | <sexpr>   | <qexpr>;                  \
       lispy   : /^/ <expr>* /$/ ;                     \
     ",
-    Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+    Double, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
   /* Print version and exit information */
   puts("Lispy Version 0.0.0.1");
   puts("Press Ctrl+c to Exit\n");
 
+  /* Options come before any file is loaded */
+  for (int i = 1; i < argc; i++) {
+    /* Use the tree-walking evaluator, e.g. for differential testing */
+    if (strcmp(argv[i], "--reference") == 0) { use_vm = 0; }
+
+    /* Allocate from a region per top level expression */
+    if (strcmp(argv[i], "--arena") == 0) { use_arena = 1; }
+  }
+
+  sym_amp = sym_intern("&");
+  sym_if = sym_intern("if");
+
   lenv* e = lenv_new();
+  lenv_global = e;
   lenv_add_builtins(e);
 
   /* Supplied with a list of files */
@@ -1252,6 +5590,9 @@ int main(int argc, char** argv) {
     /* loop over each supplied filename (starting from 1) */
     for (int i = 1; i < argc; i++) {
 
+      /* Skip options */
+      if (strncmp(argv[i], "--", 2) == 0) { continue; }
+
       /* Argument list with a single argument, the filename */
       lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
 
@@ -1259,8 +5600,9 @@ int main(int argc, char** argv) {
       lval* x = builtin_load(e, args);
 
       /* If the result is an error be sure to print it */
-      if (x->type == LVAL_ERR) { lval_println(e, x); }
+      if (LTYPE(x) == LVAL_ERR) { lval_println(e, x); }
       lval_del(x);
+      gc_safepoint(e);
     }
   }
 
@@ -1275,9 +5617,12 @@ int main(int argc, char** argv) {
     /* Attempt to Parse the user input */
     mpc_result_t r;
     if (mpc_parse("<stdin>", input, Lispy, &r)) {
+      larena m = arena_open();
       lval* x = lval_eval(e, lval_read(r.output));
       lval_println(e, x);
       lval_del(x);
+      arena_close(m);
+      gc_safepoint(e);
 
       mpc_ast_delete(r.output);
     } else {
@@ -1293,7 +5638,8 @@ int main(int argc, char** argv) {
   lenv_del(e);
 
   /* Undefine and Delete our Parsers */
-  mpc_cleanup(4, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+  mpc_cleanup(9, Double, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr,
+    Lispy);
 
   return 0;
 }